@@ -0,0 +1,31 @@
+#!/bin/bash
+# Host density: Starts dvm with TENANTS copies of the hello world program,
+# each with CONCURRENCY request VMs, and reports the resident memory and
+# the number of threads, in total and per tenant.
+TENANTS=${TENANTS:-200}
+CONCURRENCY=${CONCURRENCY:-32}
+WAIT=${WAIT:-10}
+CONFIG=$(mktemp --suffix=.json)
+
+{
+	echo "{"
+	echo "	\"density\": { \"concurrency\": $CONCURRENCY, \"max_memory\": 8, \"address_space\": 8 }"
+	for i in $(seq 1 $TENANTS); do
+		echo "	,\"t$i.com\": { \"group\": \"density\", \"start\": true, \"filename\": \"$PWD/program/hello_world\" }"
+	done
+	echo "}"
+} > $CONFIG
+
+./.build/dvm --config $CONFIG -d t1.com $* > /dev/null 2>&1 &
+DVM_PID=$!
+sleep $WAIT
+
+RSS_KB=$(awk '/^VmRSS:/ { print $2 }' /proc/$DVM_PID/status)
+THREADS=$(awk '/^Threads:/ { print $2 }' /proc/$DVM_PID/status)
+echo "Tenants: $TENANTS, VMs per tenant: $CONCURRENCY"
+echo "RSS: $((RSS_KB / 1024)) MiB, $((RSS_KB / TENANTS)) KiB per tenant"
+echo "Threads: $THREADS, $(echo "scale=2; $THREADS / $TENANTS" | bc) per tenant"
+
+kill -n 9 $DVM_PID
+wait $DVM_PID > /dev/null 2>&1
+rm -f $CONFIG
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Tail latency of a fast tenant while a slow tenant keeps VMs busy.
+# Run once with and once without --io-threads to compare, e.g.:
+#   ./mixed_latency.sh
+#   ./mixed_latency.sh --io-threads 4
+FAST=${FAST:-test.com}
+SLOW=${SLOW:-avif}
+WRK=${WRK:-./wrk}
+
+./.build/dvm --no-ephemeral $* > /dev/null 2>&1 &
+DVM_PID=$!
+sleep 1
+
+# 1. Keep the slow tenant busy
+$WRK -c4 -t4 -d15s http://127.0.0.1:8080/ -H "Host: $SLOW" > /dev/null &
+SLOW_PID=$!
+sleep 1
+
+# 2. Measure the fast tenant
+$WRK -c16 -t16 -d10s -L http://127.0.0.1:8080/ -H "Host: $FAST"
+
+wait $SLOW_PID
+kill -n 9 $DVM_PID
+wait $DVM_PID > /dev/null 2>&1
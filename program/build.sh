@@ -7,3 +7,5 @@ $CXX -static -O2 -std=c++20 -Wl,-Ttext-segment=0x40200000 $STORAGE.cpp -o $STORA
 
 objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=!_Z*remote* --strip-symbol=* $STORAGE /tmp/storage.syms
 $CXX -static -O2 -std=c++20 -Wl,--just-symbols=/tmp/storage.syms $MAIN.cpp -o $MAIN
+
+$CXX -static -O2 -std=c++20 reset_bench.cpp -o reset_bench
@@ -102,6 +102,40 @@ extern void wait_for_requests();
    data can be retrieved from the struct kvm_request argument. */
 extern void wait_for_requests_paused(struct kvm_request* req);
 
+/* Wait for a batch of up to max requests by pausing the machine. The
+   host fills in requests[0..count) and resumes the program, which must
+   fill in responses[0..count) and then wait again, which concludes the
+   whole batch. backend_response() is not used. Request bodies in a batch
+   are always in the inputs area. The batch size cannot change, and is
+   limited to 64 requests. For example:
+
+	static struct kvm_request  reqs[16];
+	static struct kvm_response resps[16];
+	struct kvm_request_batch batch = { reqs, resps, 16, 0, 0 };
+	while (1) {
+		wait_for_requests_batch_paused(&batch);
+		for (uint16_t i = 0; i < batch.count; i++)
+			my_handler(&reqs[i], &resps[i]);
+	}
+*/
+struct BackendResponseExtra;
+struct kvm_response {
+	int16_t     status;
+	const void *content_type;
+	size_t      content_type_len;
+	const void *content;
+	size_t      content_len;
+	const struct BackendResponseExtra *extra; /* Can be NULL. */
+};
+struct kvm_request_batch {
+	struct kvm_request  *requests;  /* Array of max requests. */
+	struct kvm_response *responses; /* Array of max responses. */
+	uint16_t max;       /* Set by the program. */
+	uint16_t count;     /* Set by the host on each resume. */
+	uint32_t reserved0; /* Reserved for future use. */
+};
+extern void wait_for_requests_batch_paused(struct kvm_request_batch* batch);
+
 /* Wait for storage resume while paused */
 extern size_t wait_for_storage_resume_paused(void** req);
 /* Wait for permanent IPRE resume while paused */
@@ -730,6 +764,15 @@ asm(".global wait_for_requests_paused\n"
 	"	ret\n"
 	".cfi_endproc\n");
 
+asm(".global wait_for_requests_batch_paused\n"
+	".type wait_for_requests_batch_paused, @function\n"
+	"wait_for_requests_batch_paused:\n"
+	".cfi_startproc\n"
+	"	mov $0x10003, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n"
+	".cfi_endproc\n");
+
 asm(".global wait_for_storage_resume_paused\n"
 	".type wait_for_storage_resume_paused, @function\n"
 	"wait_for_storage_resume_paused:\n"
@@ -19,3 +19,39 @@ void* wait_for_storage_task_paused()
 	const size_t bytes = wait_for_storage_resume_paused(&ptr);
 	return ptr;
 }
+
+/* Batched requests for runtimes that call in through FFI, and would
+   rather not lay out struct kvm_request_batch themselves. */
+#define LIBDROGON_MAX_BATCH 64
+static struct kvm_request  batch_requests[LIBDROGON_MAX_BATCH];
+static struct kvm_response batch_responses[LIBDROGON_MAX_BATCH];
+static struct kvm_request_batch request_batch = {
+	batch_requests, batch_responses, 0, 0, 0
+};
+
+/* Deliver the responses to the previous batch (if any) and wait for
+   the next one. Returns the number of requests in the new batch. */
+uint16_t wait_for_request_batch(uint16_t max)
+{
+	if (request_batch.max == 0)
+		request_batch.max = (max == 0 || max > LIBDROGON_MAX_BATCH) ? LIBDROGON_MAX_BATCH : max;
+	wait_for_requests_batch_paused(&request_batch);
+	return request_batch.count;
+}
+
+const struct kvm_request* batch_request(uint16_t i)
+{
+	return &batch_requests[i];
+}
+
+void batch_response(uint16_t i, int16_t status,
+	const void *t, size_t tlen, const void *c, size_t clen)
+{
+	struct kvm_response *resp = &batch_responses[i];
+	resp->status = status;
+	resp->content_type = t;
+	resp->content_type_len = tlen;
+	resp->content = c;
+	resp->content_len = clen;
+	resp->extra = NULL;
+}
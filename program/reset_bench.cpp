@@ -0,0 +1,38 @@
+#include "kvm_api.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* Reset microbenchmark: Each request to /kb/N writes one byte to every
+   page of N kilobytes of memory, which then has to be reset. The size
+   is in the path, as the query string is not passed to the program.
+   The memory is touched in main(), so that the pages belong to the
+   program and each request only dirties them. */
+static constexpr size_t ARENA_SIZE = 96UL << 20;
+static char* arena = nullptr;
+
+static void on_get(const char* url, const char*)
+{
+	size_t kb = 0;
+	if (strncmp(url, "/kb/", 4) == 0)
+		kb = strtoul(url + 4, nullptr, 10);
+	const size_t bytes = std::min(kb << 10, ARENA_SIZE);
+	for (size_t i = 0; i < bytes; i += 4096)
+		arena[i] = char(i >> 12);
+
+	const char ctype[] = "text/plain";
+	const char result[] = "OK";
+	backend_response(200, ctype, sizeof(ctype)-1,
+		result, sizeof(result)-1);
+}
+
+int main()
+{
+	arena = (char *)malloc(ARENA_SIZE);
+	memset(arena, 0, ARENA_SIZE);
+	printf("-== Reset benchmark program ready ==-\n");
+	fflush(stdout);
+	set_backend_get(on_get);
+	wait_for_requests();
+}
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Request throughput and latency with reservations (-r), where each
+# request is handed to the thread of its VM, against the default mode,
+# where the request thread runs its own VM.
+#
+# Set BEFORE to a dvm built from before the lock-free handoff (1400459^)
+# to also measure -r with the old task queue handoff.
+WRK=${WRK:-./wrk}
+URL=${URL:-http://127.0.0.1:8080/}
+DVM=${DVM:-./.build/dvm}
+
+measure() {
+	local label=$1
+	shift
+	"$@" > /dev/null 2>&1 &
+	DVM_PID=$!
+	sleep 1
+
+	echo "$label:"
+	$WRK -c64 -t16 -d10s --latency $URL | grep -E "Requests/sec|50%|90%|99%"
+
+	kill -n 9 $DVM_PID
+	wait $DVM_PID > /dev/null 2>&1
+}
+
+measure "dvm (no reservations)" $DVM $*
+if [ -n "$BEFORE" ]; then
+	measure "dvm -r (task queue handoff)" $BEFORE -r $*
+fi
+measure "dvm -r" $DVM -r $*
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Reset cost against the write set of a request: Each request writes to
+# KB kilobytes of memory, and the average reset time and the memory kept
+# by the request VMs are read from /stats. The reset modes are: keeping
+# all working memory, keeping none of it, and adaptive working memory.
+# There is no reset mode that uses KVM's dirty log or dirty ring, which
+# needs support in Machine::reset_to of tinykvm first. This gives the
+# baseline such a mode is to be compared against.
+# Build the program with program/build.sh first.
+WRK=${WRK:-./wrk}
+URL=${URL:-http://127.0.0.1:8080}
+SIZES=${SIZES:-"4 64 256 1024 4096 16384 65536"}
+CONFIG=$(mktemp --suffix=.json)
+
+for mode in keep free adaptive; do
+	case $mode in
+		keep)     settings="\"ephemeral_keep_working_memory\": true" ;;
+		free)     settings="\"ephemeral_keep_working_memory\": false" ;;
+		adaptive) settings="\"adaptive_working_memory\": true" ;;
+	esac
+	cat > $CONFIG <<JSON
+{
+	"reset.com": {
+		"start": true,
+		"filename": "$PWD/program/reset_bench",
+		"max_memory": 256,
+		"address_space": 512,
+		"max_request_memory": 128,
+		$settings
+	}
+}
+JSON
+	echo "Reset mode: $mode"
+	echo "write_kb reset_us banked_mb"
+	for kb in $SIZES; do
+		./.build/dvm --config $CONFIG -d reset.com -c 1 $* > /dev/null 2>&1 &
+		DVM_PID=$!
+		sleep 1
+
+		$WRK -c1 -t1 -d5s -H "Host: reset.com" "$URL/kb/$kb" > /dev/null
+		curl -s $URL/stats | python3 -c '
+import json, sys
+totals = json.load(sys.stdin)["reset.com"]["request"]["totals"]
+print("'$kb'", round(totals["reset_time_avg"] * 1e6, 1), totals["vm_bank_current"] >> 20)'
+
+		kill -n 9 $DVM_PID
+		wait $DVM_PID > /dev/null 2>&1
+	done
+done
+rm -f $CONFIG
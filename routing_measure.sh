@@ -0,0 +1,18 @@
+#!/bin/bash
+# Cost of tenant routing at full request rate. /drogon is answered before
+# routing, and an unknown subdomain walks every table in the router
+# without reaching a VM, so the difference is the dispatch cost.
+WRK=${WRK:-./wrk}
+HOST=${HOST:-no.such.sub.domain.test}
+
+./.build/dvm $* > /dev/null 2>&1 &
+DVM_PID=$!
+sleep 1
+
+echo "Without routing:"
+$WRK -c64 -t16 -d10s http://127.0.0.1:8080/drogon | grep Requests/sec
+echo "With routing ($HOST):"
+$WRK -c64 -t16 -d10s http://127.0.0.1:8080/some/path -H "Host: $HOST" | grep Requests/sec
+
+kill -n 9 $DVM_PID
+wait $DVM_PID > /dev/null 2>&1
@@ -1,8 +1,13 @@
 #include <drogon/drogon.h>
 #include <tinykvm/util/scoped_profiler.hpp>
 #include "sandbox/tenants.hpp"
+#include "sandbox/http_fields.hpp"
+#include "sandbox/kvm_settings.h"
+#include "sandbox/memory_governor.hpp"
 #include "sandbox/program_instance.hpp"
 #include "sandbox/scoped_duration.hpp"
+#include "sandbox/timing.hpp"
+#include "guest_writer.hpp"
 #include "settings.hpp"
 static constexpr size_t BACKEND_INPUTS_SIZE = 64UL << 10; // 64KB
 using namespace drogon;
@@ -32,117 +37,303 @@ struct backend_inputs {
 	uint64_t reserved1[2]; /* Reserved for future use. */
 };
 
-static void fill_backend_inputs(
-	kvm::MachineInstance& machine, __u64& stack,
-	const HttpRequestPtr& req,
-	backend_inputs& inputs)
+/* Guest struct BackendResponseExtra, passed in r9 to backend_response(). */
+struct backend_response_extra {
+	uint64_t headers; /* const struct ResponseHeader* */
+	uint16_t num_headers;
+	bool     cached;
+	float    ttl;
+	float    grace;
+	float    keep;
+	uint64_t reserved[4];
+};
+static_assert(sizeof(backend_response_extra) == 56, "Must match BackendResponseExtra");
+struct response_header {
+	uint64_t field; /* "Key: Value" */
+	uint64_t field_len;
+};
+/* Guest struct kvm_response, filled in by batched programs. */
+struct backend_batch_response {
+	int16_t  status;
+	uint64_t ctype;
+	uint64_t ctype_len;
+	uint64_t content;
+	uint64_t content_len;
+	uint64_t extra; /* const struct BackendResponseExtra* */
+};
+static_assert(sizeof(backend_batch_response) == 48, "Must match kvm_response");
+/* Guest struct kvm_request_batch, passed to wait_for_requests_batch_paused(). */
+struct backend_request_batch {
+	uint64_t requests;  /* struct kvm_request[max] */
+	uint64_t responses; /* struct kvm_response[max] */
+	uint16_t max;
+	uint16_t count;
+	uint32_t reserved0;
+};
+static_assert(sizeof(backend_request_batch) == 24, "Must match kvm_request_batch");
+static constexpr size_t MAX_EXTRA_HEADERS = 128;
+static constexpr size_t MAX_EXTRA_FIELD_LEN = 8192;
+
+static std::string_view http_method_string(HttpMethod method)
+{
+	switch (method) {
+	case HttpMethod::Get:     return "GET";
+	case HttpMethod::Post:    return "POST";
+	case HttpMethod::Put:     return "PUT";
+	case HttpMethod::Delete:  return "DELETE";
+	case HttpMethod::Patch:   return "PATCH";
+	case HttpMethod::Options: return "OPTIONS";
+	case HttpMethod::Head:    return "HEAD";
+	default:                  return "";
+	}
+}
+
+static bool iequals(std::string_view a, std::string_view b)
 {
-	auto& vm = machine.machine();
-	// Set HTTP method
-	switch (req->getMethod()) {
-	case HttpMethod::Get:
-		inputs.method_len = 3;
-		inputs.method     = vm.stack_push_cstr(stack, "GET");
-		break;
-	case HttpMethod::Post:
-		inputs.method_len = 4;
-		inputs.method     = vm.stack_push_cstr(stack, "POST");
-		break;
-	case HttpMethod::Put:
-		inputs.method_len = 3;
-		inputs.method     = vm.stack_push_cstr(stack, "PUT");
-		break;
-	case HttpMethod::Delete:
-		inputs.method_len = 6;
-		inputs.method     = vm.stack_push_cstr(stack, "DELETE");
-		break;
-	case HttpMethod::Patch:
-		inputs.method_len = 5;
-		inputs.method     = vm.stack_push_cstr(stack, "PATCH");
-		break;
-	case HttpMethod::Options:
-		inputs.method_len = 7;
-		inputs.method     = vm.stack_push_cstr(stack, "OPTIONS");
-		break;
-	case HttpMethod::Head:
-		inputs.method_len = 4;
-		inputs.method     = vm.stack_push_cstr(stack, "HEAD");
-		break;
-	default:
-		inputs.method_len = 0;
-		inputs.method     = vm.stack_push_cstr(stack, "");
-		break;
-	}
-	// Set URL
-	inputs.url_len = req->getPath().length();
-	inputs.url     = vm.stack_push(stack, req->getPath().data(), inputs.url_len + 1);
-	// Set argument
-	inputs.arg_len = req->query().length();
-	inputs.arg     = vm.stack_push(stack, req->query().data(), inputs.arg_len + 1);
-	// If there's a POST body
-	if (req->body().length() > 0) {
-		// Set content-type, if available
-		const auto& content_type = req->getHeader("Content-Type");
-		inputs.ctype = vm.stack_push(stack, content_type.data(), content_type.length() + 1);
-		inputs.ctype_len = content_type.length();
-		inputs.data  = vm.stack_push(stack, req->body().data(), req->body().length());
-		inputs.data_len = req->body().length();
-		machine.stats().input_bytes += req->body().length();
-	}
-	else
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+/* Gives the HTTP system calls access to the live Drogon request. The
+   response does not exist until the VM has returned, so its header
+   fields are collected here and applied to it afterwards. */
+struct DrogonHttpFields final : public kvm::HttpFields {
+	using header_list = std::vector<std::pair<std::string, std::string>>;
+
+	DrogonHttpFields(kvm::MachineInstance& inst, const HttpRequestPtr& req)
+		: m_inst(inst), m_req(req)
 	{
-		/* Guarantee readable strings. */
-		inputs.ctype = inputs.url + inputs.url_len; // Guaranteed zero-terminated.
-		inputs.ctype_len = 0;
-		/* Buffers with known length can be NULL. */
-		inputs.data  = 0;
-		inputs.data_len = 0;
+		inst.set_http_fields(this);
+	}
+	~DrogonHttpFields() {
+		m_inst.set_http_fields(nullptr);
+	}
+
+	bool find(int where, std::string_view key, std::string_view& value) override
+	{
+		if (where == REQ) {
+			const std::string& field = m_req->getHeader(std::string(key));
+			if (field.empty())
+				return false;
+			value = field;
+			return true;
+		} else if (where == RESP) {
+			for (const auto& header : m_resp_headers) {
+				if (iequals(header.first, key)) {
+					value = header.second;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+	bool set(int where, std::string_view key, std::string_view value) override
+	{
+		if (where == RESP)
+			this->unset(RESP, key);
+		return this->append(where, key, value);
+	}
+	bool append(int where, std::string_view key, std::string_view value) override
+	{
+		if (where == REQ) {
+			/* Request header fields are unique in Drogon. */
+			m_req->addHeader(std::string(key), std::string(value));
+			return true;
+		} else if (where == RESP) {
+			m_resp_headers.emplace_back(key, value);
+			return true;
+		}
+		return false;
+	}
+	bool unset(int where, std::string_view key) override
+	{
+		if (where == REQ) {
+			m_req->removeHeader(std::string(key));
+			return true;
+		} else if (where == RESP) {
+			std::erase_if(m_resp_headers, [key] (const auto& header) {
+				return iequals(header.first, key);
+			});
+			return true;
+		}
+		return false;
 	}
-	inputs.prng[0] = machine.rand_uint64();
-	inputs.prng[1] = machine.rand_uint64();
+	std::string_view method() const override {
+		return http_method_string(m_req->getMethod());
+	}
+
+	const header_list& response_headers() const noexcept { return m_resp_headers; }
+	void clear_response_headers() { m_resp_headers.clear(); }
+	void apply(const HttpResponsePtr& resp) const {
+		for (const auto& header : m_resp_headers) {
+			resp->addHeader(header.first, header.second);
+		}
+	}
+
+private:
+	kvm::MachineInstance& m_inst;
+	const HttpRequestPtr& m_req;
+	header_list m_resp_headers;
+};
+
+/* Visit each "Key: Value" field of the extra response header array.
+   Fields are viewed in place in guest memory, unless they cross into
+   a non-contiguous page, and only then are they copied. */
+template <typename Func>
+static void foreach_extra_header(tinykvm::Machine& vm,
+	const backend_response_extra& extra, Func&& func)
+{
+	if (extra.headers == 0x0 || extra.num_headers == 0)
+		return;
+	if (UNLIKELY(extra.num_headers > MAX_EXTRA_HEADERS))
+		throw std::runtime_error("Too many extra response headers");
+
+	response_header headers[MAX_EXTRA_HEADERS];
+	vm.copy_from_guest(headers, extra.headers, extra.num_headers * sizeof(response_header));
+
+	thread_local std::string scratch;
+	for (size_t i = 0; i < extra.num_headers; i++)
+	{
+		const auto& header = headers[i];
+		if (UNLIKELY(header.field_len > MAX_EXTRA_FIELD_LEN))
+			throw std::runtime_error("Extra response header field too long");
+
+		tinykvm::Machine::Buffer buffers[4];
+		const size_t cnt = vm.gather_buffers_from_range(4, buffers, header.field, header.field_len);
+		std::string_view field;
+		if (cnt == 1) {
+			field = std::string_view(buffers[0].ptr, buffers[0].len);
+		} else {
+			scratch.resize(header.field_len);
+			vm.copy_from_guest(scratch.data(), header.field, header.field_len);
+			field = scratch;
+		}
+		std::string_view key, value;
+		if (kvm::HttpFields::split_field(field, key, value) && !key.empty()) {
+			func(key, value);
+		}
+	}
+}
+
+/* The top of the inputs area in the guest, allocated on first use. */
+static uint64_t backend_inputs_top(kvm::MachineInstance& inst)
+{
+	if (inst.get_inputs_allocation() == 0) {
+		inst.get_inputs_allocation() = inst.machine().mmap_allocate(BACKEND_INPUTS_SIZE) + BACKEND_INPUTS_SIZE;
+		// Allocated backend inputs struct at guest address 0x61457000
+		printf("Allocated backend inputs struct at guest address 0x%lX\n", inst.get_inputs_allocation());
+	}
+	return inst.get_inputs_allocation();
+}
+
+/* The space a request takes in the inputs area, not counting the body. */
+static size_t backend_inputs_size(const HttpRequestPtr& req, bool eager_headers)
+{
+	size_t total = http_method_string(req->getMethod()).size() + 1
+		+ req->getPath().size() + 1 + req->query().size() + 1;
+	if (!req->body().empty()) {
+		total += req->getHeader("Content-Type").size();
+	}
+	total += 1;
+	if (eager_headers) {
+		for (const auto& header : req->getHeaders()) {
+			total += sizeof(backend_header)
+				+ header.first.size() + 2 + header.second.size() + 1;
+		}
+	}
+	return total;
 }
-static size_t fill_backend_headers(
-	kvm::MachineInstance& machine, __u64& stack,
+
+/* Lay out the request strings, the header array and the header fields
+   directly in the inputs area of the guest, in one pass, below top.
+   The area is filled from the top down, just like a stack, and host
+   pointers into it are gathered once so that nothing is formatted in
+   host temporaries before being copied. Returns the new (lower) top. */
+static uint64_t marshal_backend_inputs(
+	kvm::MachineInstance& inst,
 	const HttpRequestPtr& req,
-	backend_inputs& inputs)
+	backend_inputs& inputs,
+	const uint64_t top,
+	const size_t capacity)
 {
-	auto& vm = machine.machine();
-	/* Allocate space for headers on the stack */
-	const size_t num_headers = req->getHeaders().size();
-	/* If there are no headers, return */
-	if (num_headers == 0) {
-		inputs.g_headers = 0;
-		inputs.num_headers = 0;
-		return 0;
-	}
-	std::array<backend_header, 64> header_array;
-	if (num_headers > header_array.size()) {
-		throw std::runtime_error("Too many headers in backend inputs");
-	}
-	/* Push each header field to the stack */
+	auto& vm = inst.machine();
+	const std::string_view method = http_method_string(req->getMethod());
+	const std::string& path  = req->getPath();
+	const std::string& query = req->query();
+	const std::string_view body = req->body();
 	const auto& req_headers = req->getHeaders();
-	size_t n = 0;
-	char buffer[16384]; // 16KB buffer for header field
-	for (const auto& header : req_headers) {
-		auto& guest_header = header_array.at(n++);
-		const int len = snprintf(buffer, sizeof(buffer), "%.*s: %.*s",
-			(int)header.first.length(), header.first.data(),
-			(int)header.second.length(), header.second.data());
-		if (len < 0 || len >= sizeof(buffer)) {
-			throw std::runtime_error("Header field too long: " + header.first);
-		}
-		guest_header.field_ptr
-			= vm.stack_push_cstr(stack, buffer, len);
-		guest_header.field_colon = header.first.length();
-		guest_header.field_len = len;
-	}
-	/* Push the header array to the stack using stack_push_std_array */
-	const auto header_array_addr = vm.stack_push_std_array(stack, header_array, num_headers);
-	/* Set the header array address and number of headers */
-	inputs.g_headers = header_array_addr;
+	/* Tenants may look up header fields with http_find() instead. */
+	const bool eager_headers = inst.tenant().config.group.eager_headers;
+	static const std::string empty_ctype;
+	const std::string& ctype = body.empty() ? empty_ctype : req->getHeader("Content-Type");
+
+	/* Calculate the total size up front. */
+	const size_t num_headers = eager_headers ? req_headers.size() : 0;
+	const size_t array_bytes = num_headers * sizeof(backend_header);
+	size_t total = backend_inputs_size(req, eager_headers);
+	/* Large bodies go into the separate POST data area.
+	   NOTE: Leave room for aligning the base address. */
+	const size_t room = capacity - 16;
+	const bool inline_body = total + body.size() <= room;
+	if (inline_body) {
+		total += body.size();
+	} else if (UNLIKELY(total > room)) {
+		throw std::runtime_error("Request too large for backend inputs area");
+	}
+	const uint64_t base = (top - total) & ~uint64_t(0xF);
+
+	thread_local std::vector<tinykvm::Machine::WrBuffer> buffers;
+	buffers.clear();
+	vm.writable_buffers_from_range(buffers, base, top - base);
+
+	GuestWriter array(buffers, base);
+	GuestWriter strings(buffers, base, array_bytes);
+
+	inputs.method_len = method.size();
+	inputs.method     = strings.write_cstr(method);
+	inputs.url_len    = path.size();
+	inputs.url        = strings.write_cstr(path);
+	inputs.arg_len    = query.size();
+	inputs.arg        = strings.write_cstr(query);
+
+	/* Content-type is only set when there's a POST body, but
+	   it's always a readable (zero-terminated) string. */
+	inputs.ctype_len  = ctype.size();
+	inputs.ctype      = strings.write_cstr(ctype);
+	if (!body.empty()) {
+		if (inline_body) {
+			inputs.data = strings.write(body);
+		} else {
+			inputs.data = inst.allocate_post_data(body.size());
+			vm.copy_to_guest(inputs.data, body.data(), body.size());
+		}
+		inputs.data_len = body.size();
+		inst.stats().input_bytes += body.size();
+	} else {
+		/* Buffers with known length can be NULL. */
+		inputs.data  = 0;
+		inputs.data_len = 0;
+	}
+
+	/* Header fields are written as "key: value" with zero-termination,
+	   and the header array is filled out alongside them. */
+	if (eager_headers) {
+		for (const auto& header : req_headers) {
+			backend_header guest_header;
+			guest_header.field_ptr = strings.write(header.first);
+			strings.write(": ", 2);
+			strings.write_cstr(header.second);
+			guest_header.field_colon = header.first.size();
+			guest_header.field_len = header.first.size() + 2 + header.second.size();
+			array.write(&guest_header, sizeof(guest_header));
+		}
+	}
+	inputs.g_headers   = (num_headers > 0) ? base : 0;
 	inputs.num_headers = num_headers;
-	inputs.reqid = machine.request_id();
-	return num_headers;
+	inputs.reqid = inst.request_id();
+
+	inputs.prng[0] = inst.rand_uint64();
+	inputs.prng[1] = inst.rand_uint64();
+	return base;
 }
 
 static void kvm_handle_request(kvm::MachineInstance& inst, const HttpRequestPtr& req, bool ephemeral, bool warmup)
@@ -200,14 +391,18 @@ static void kvm_handle_request(kvm::MachineInstance& inst, const HttpRequestPtr&
 			}
 			/* Allocate space for struct backend_inputs */
 			struct backend_inputs inputs {};
-			if (inst.get_inputs_allocation() == 0) {
-				inst.get_inputs_allocation() = vm.mmap_allocate(BACKEND_INPUTS_SIZE) + BACKEND_INPUTS_SIZE;
-				// Allocated backend inputs struct at guest address 0x61457000
-				printf("Allocated backend inputs struct at guest address 0x%lX\n", inst.get_inputs_allocation());
+			const uint64_t inputs_top = backend_inputs_top(inst);
+			{
+#ifdef ENABLE_TIMING
+				TIMING_LOCATION(t0);
+#endif
+				marshal_backend_inputs(inst, req, inputs, inputs_top, BACKEND_INPUTS_SIZE);
+#ifdef ENABLE_TIMING
+				TIMING_LOCATION(t1);
+				static kvm::Timing marshal_timing("backend inputs marshalling");
+				marshal_timing.add(t0, t1);
+#endif
 			}
-			__u64 stack = inst.get_inputs_allocation();
-			fill_backend_inputs(inst, stack, req, inputs);
-			fill_backend_headers(inst, stack, req, inputs);
 			inputs.info_flags = warmup ? 1 : 0;
 
 			auto& regs = vm.registers();
@@ -230,63 +425,888 @@ static void kvm_handle_request(kvm::MachineInstance& inst, const HttpRequestPtr&
 	}
 }
 
-void kvm_compute(kvm::TenantInstance& tenant,
+/* Without reservations, a thread keeps the VMs it used, unless the
+   tenant has fewer VMs than there are threads. Then every request
+   borrows a VM from the tenant, and gives it back afterwards. */
+static bool uses_sticky_slot(const kvm::TenantInstance& tenant)
+{
+	return !g_settings.reservations
+		&& tenant.config.group.max_concurrency >= size_t(g_settings.num_threads());
+}
+/* Give back the VM, which is reset in the background. */
+static void release_slot(kvm::VMPoolItem* slot)
+{
+	if (g_settings.reservations) {
+		kvm::ProgramInstance::vm_free_function(slot);
+	} else if (!uses_sticky_slot(slot->mi->tenant())) {
+		slot->deferred_free();
+	} else {
+		slot->deferred_reset();
+	}
+}
+
+/* A response body that is sent straight out of guest memory. The VM
+   is held back from being reset until Drogon has finished writing the
+   body to the socket, and is then released like any other request.
+   The body is either already complete in guest memory, or it is
+   produced piece by piece by a guest callback (streaming responses).
+   If the VM is needed again before the body is written, the remainder
+   is detached into host memory first. */
+struct GuestResponseBody {
+	/* Body that is fully present in guest memory. */
+	GuestResponseBody(kvm::VMPoolItem* s, tinykvm::Machine& vm, uint64_t addr, size_t len)
+		: slot(s), buffers(len / 4096 + 2)
+	{
+		const size_t n = vm.gather_buffers_from_range(buffers.size(), buffers.data(), addr, len);
+		buffers.resize(n);
+	}
+	/* Body produced by content_stream_func(arg, max, written, total). */
+	GuestResponseBody(kvm::VMPoolItem* s, uint64_t callback, uint64_t arg, size_t total, uint64_t stack)
+		: slot(s), stream_func(callback), stream_arg(arg), stream_stack(stack), stream_total(total)
+	{
+	}
+	~GuestResponseBody() { this->release(); }
+
+	size_t read(char* dst, size_t max)
+	{
+		if (slot == nullptr) {
+			const size_t n = std::min(max, detached.size() - offset);
+			std::memcpy(dst, detached.data() + offset, n);
+			offset += n;
+			return n;
+		}
+		if (stream_func != 0x0) {
+			return this->read_stream(dst, max);
+		}
+		size_t total = 0;
+		while (total < max && index < buffers.size()) {
+			const auto& buf = buffers[index];
+			const size_t n = std::min(max - total, buf.len - offset);
+			std::memcpy(dst + total, buf.ptr + offset, n);
+			total  += n;
+			offset += n;
+			if (offset == buf.len) {
+				index ++;
+				offset = 0;
+			}
+		}
+		return total;
+	}
+	void detach()
+	{
+		if (slot == nullptr)
+			return;
+		std::string remainder;
+		if (stream_func != 0x0) {
+			/* Run the guest callback until the stream is complete. */
+			char buffer[16384];
+			while (size_t n = this->read_stream(buffer, sizeof(buffer))) {
+				remainder.append(buffer, n);
+			}
+		} else {
+			for (size_t i = index; i < buffers.size(); i++) {
+				const size_t skip = (i == index) ? offset : 0;
+				remainder.append(buffers[i].ptr + skip, buffers[i].len - skip);
+			}
+		}
+		this->detached = std::move(remainder);
+		this->offset = 0;
+		this->release();
+	}
+	void release()
+	{
+		if (slot == nullptr)
+			return;
+		release_slot(slot);
+		slot = nullptr;
+	}
+	/* The request failed before the body was handed off, and
+	   the VM is released by the request instead. */
+	void disown()
+	{
+		slot = nullptr;
+		buffers.clear();
+	}
+
+	kvm::VMPoolItem* slot;
+	std::vector<tinykvm::Machine::Buffer> buffers;
+	size_t index  = 0;
+	size_t offset = 0;
+	std::string detached;
+
+private:
+	size_t read_stream(char* dst, size_t max)
+	{
+		if (stream_written >= stream_total)
+			return 0;
+		struct {
+			char*  dst;
+			size_t max;
+		} io { dst, std::min(max, stream_total - stream_written) };
+		auto func = [this, &io] () -> long {
+			auto& inst = *slot->mi;
+			auto& vm = inst.machine();
+			kvm::ScopedDuration cputime(inst.stats().request_cpu_time);
+			/* Call into the guest on a stack below the suspended request. */
+			vm.timed_vmcall_stack(stream_func, stream_stack, kvm::STREAM_HANDLING_TIMEOUT,
+				stream_arg, uint64_t(io.max), uint64_t(stream_written), uint64_t(stream_total));
+			/* struct streaming_content is returned in RAX:RDX */
+			const auto& regs = vm.registers();
+			const size_t len = std::min(size_t(regs.rdx), io.max);
+			vm.copy_from_guest(io.dst, regs.rax, len);
+			inst.stats().output_bytes += len;
+			return len;
+		};
+		size_t n = 0;
+		try {
+			if (g_settings.reservations) {
+				n = slot->run(func);
+			} else {
+				n = func();
+			}
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s: Streaming response exception: %s\n",
+				slot->mi->name().c_str(), e.what());
+			slot->mi->stats().exceptions ++;
+			slot->mi->reset_needed_now();
+		}
+		if (n == 0) {
+			/* Stalled or failed delivery ends the stream. */
+			this->stream_total = this->stream_written;
+			return 0;
+		}
+		this->stream_written += n;
+		return n;
+	}
+
+	uint64_t stream_func  = 0x0;
+	uint64_t stream_arg   = 0x0;
+	uint64_t stream_stack = 0x0;
+	size_t   stream_total = 0;
+	size_t   stream_written = 0;
+};
+
+/* Take back a VM that may still be sending a response body. */
+static void reclaim_response_body(std::weak_ptr<GuestResponseBody>& pending)
+{
+	if (auto body = pending.lock()) {
+		body->detach();
+	}
+	pending.reset();
+}
+
+/* In asynchronous mode the body is written from an I/O loop, which
+   must not call into the VM: A sticky VM belongs to the thread that runs
+   kvm_compute(), and reserved or borrowed VMs go back to their pool.
+   Copy the body out before returning, whatever kind of VM it came from.
+   Otherwise a sticky VM remembers its body (pending is non-null), so
+   that the body can be taken back when the VM is needed again. */
+static void set_pending_body(std::weak_ptr<GuestResponseBody>* pending,
+	const std::shared_ptr<GuestResponseBody>& body)
+{
+	if (g_settings.async()) {
+		body->detach();
+	} else if (pending != nullptr) {
+		*pending = body;
+	}
+}
+
+/* Status code statistics */
+static void count_status(kvm::MachineStats& stats, uint16_t status)
+{
+	if (LIKELY(status >= 200 && status < 300)) {
+		stats.status_2xx++;
+	} else if (UNLIKELY(status < 200)) {
+		stats.status_unknown ++;
+	} else if (status < 400) {
+		stats.status_3xx++;
+	} else if (status < 500) {
+		stats.status_4xx++;
+	} else if (status < 600) {
+		stats.status_5xx++;
+	} else {
+		stats.status_unknown++;
+	}
+}
+
+static bool is_cacheable_request(const HttpRequestPtr& req)
+{
+	return req->getMethod() == HttpMethod::Get || req->getMethod() == HttpMethod::Head;
+}
+/* Tenant + method + host + URL + the tenants selected request headers.
+   The tenant is implied, as each tenant has its own cache. The host is
+   needed, as wildcards and routes send many hosts to the same tenant,
+   and it is normalized the same way as when routing. */
+static std::string cache_key(const kvm::TenantInstance& tenant, const HttpRequestPtr& req)
+{
+	std::string key;
+	key.reserve(128);
+	key += http_method_string(req->getMethod());
+	key += ' ';
+	kvm::Router::append_host(key, req->getHeader("Host"));
+	key += req->path();
+	if (!req->query().empty()) {
+		key += '?';
+		key += req->query();
+	}
+	for (const auto& name : tenant.config.group.cache_vary) {
+		key += '\n';
+		key += req->getHeader(name);
+	}
+	return key;
+}
+/* The caching decision that came with a response. */
+static kvm::MachineInstance::Cacheable cacheable_from(const backend_response_extra& extra)
+{
+	auto duration = [] (float seconds) -> uint32_t {
+		return std::clamp(seconds * 1000.0f, 0.0f, float(UINT32_MAX));
+	};
+	return {
+		.cached   = bool(extra.cached),
+		.ttl_ms   = duration(extra.ttl),
+		.grace_ms = duration(extra.grace),
+		.keep_ms  = duration(extra.keep),
+	};
+}
+static void set_cached_response(HttpResponsePtr& resp, const kvm::CachedResponse& cached)
+{
+	resp->setStatusCode((drogon::HttpStatusCode)cached.status);
+	resp->setContentTypeString(cached.content_type);
+	resp->setBody(cached.body);
+	for (const auto& header : cached.headers) {
+		resp->addHeader(header.first, header.second);
+	}
+}
+
+/* Let the program produce a response for an error, within a small
+   time budget. Returns false if there is no error handler, or if the
+   error handler failed too. The VM must be reset afterwards. */
+static bool kvm_handle_error(kvm::MachineInstance& inst, const HttpRequestPtr& req,
+	const std::string& exception, HttpResponsePtr& resp)
+{
+	const auto on_error_addr = inst.program().entry_at(
+		kvm::ProgramEntryIndex::ON_ERROR);
+	auto& vm = inst.machine();
+	if (on_error_addr == 0x0 || vm.is_remote_connected())
+		return false;
+
+	kvm::ScopedDuration cputime(inst.stats().error_cpu_time);
+	try {
+		inst.begin_call();
+		vm.timed_vmcall(on_error_addr,
+			kvm::ERROR_HANDLING_TIMEOUT,
+			req->getPath(),
+			"",
+			exception);
+		if (!inst.response_called(1))
+			return false;
+
+		const auto& regs = vm.registers();
+		resp = HttpResponse::newHttpResponse();
+		resp->setStatusCode((drogon::HttpStatusCode)uint16_t(regs.rdi));
+		resp->setContentTypeString(vm.buffer_to_string(regs.rsi, uint16_t(regs.rdx)));
+		resp->setBody(vm.buffer_to_string(regs.rcx, regs.r8));
+		if (regs.r9 != 0x0) {
+			backend_response_extra extra;
+			vm.copy_from_guest(&extra, regs.r9, sizeof(extra));
+			foreach_extra_header(vm, extra,
+			[&] (std::string_view key, std::string_view value) {
+				resp->addHeader(std::string(key), std::string(value));
+			});
+		}
+		return true;
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s: Error handler exception: %s\n",
+			inst.name().c_str(), e.what());
+		return false;
+	}
+}
+
+/* Respond to a request that failed: With a kept response from the
+   cache, or else with the programs own error response, if use_handler
+   is set, or else with a 500. Returns false if the error handler was
+   tried and failed, and should not be tried again for this VM. */
+static bool respond_with_error(kvm::TenantInstance& tenant, kvm::VMPoolItem* r_slot,
+	const HttpRequestPtr& req, const std::string& exception, HttpResponsePtr& resp,
+	DrogonHttpFields* http, bool use_handler)
+{
+	kvm::ResponseCache::response_ptr kept;
+	if (tenant.response_cache != nullptr && is_cacheable_request(req)) {
+		kept = tenant.response_cache->lookup_kept(cache_key(tenant, req));
+	}
+	if (kept != nullptr) {
+		resp = HttpResponse::newHttpResponse();
+		set_cached_response(resp, *kept);
+		return use_handler;
+	}
+	/* Header fields from the failed request are dropped. */
+	if (http != nullptr)
+		http->clear_response_headers();
+	bool handled = false;
+	if (use_handler) {
+		kvm::MachineInstance* inst = r_slot->mi.get();
+		if (g_settings.reservations) {
+			handled = r_slot->run([inst, &req, &exception, &resp] () -> long {
+				return kvm_handle_error(*inst, req, exception, resp);
+			});
+		} else {
+			handled = kvm_handle_error(*inst, req, exception, resp);
+		}
+	}
+	if (handled) {
+		if (http != nullptr)
+			http->apply(resp);
+	} else {
+		resp = HttpResponse::newHttpResponse();
+		resp->setStatusCode(k500InternalServerError);
+	}
+	return handled;
+}
+
+/* Wakes up requests waiting on a coalesced cache miss. */
+struct CoalescedMiss {
+	kvm::ResponseCache* cache = nullptr;
+	std::string key;
+
+	~CoalescedMiss() {
+		if (cache != nullptr)
+			cache->coalesce_done(key);
+	}
+};
+
+/* Deliver a cached response, without reserving a VM. */
+bool kvm_cache_lookup(kvm::TenantInstance& tenant,
 	const HttpRequestPtr& req, HttpResponsePtr& resp)
 {
-	thread_local kvm::VMPoolItem* slot = nullptr;
-	thread_local kvm::VMPoolItem* alternate_slot = nullptr;
-	kvm::VMPoolItem* r_slot = nullptr;
+	auto* cache = tenant.response_cache.get();
+	if (cache == nullptr || !is_cacheable_request(req))
+		return false;
 
-	if (g_settings.reservations) {
-		if (UNLIKELY((r_slot = tenant.vmreserve(false)) == nullptr)) {
-			resp->setStatusCode(k500InternalServerError);
+	kvm::ResponseCache::response_ptr cached;
+	if (cache->lookup(cache_key(tenant, req), cached) == kvm::ResponseCache::Result::Miss)
+		return false;
+	set_cached_response(resp, *cached);
+	return true;
+}
+
+/* Without reservations, each thread keeps the VMs it used between
+   requests, for a few tenants at a time. A tenant that is not cached
+   takes the place of the least recently used one, whose VMs are put
+   back in their queue once they have been reset.
+
+   Reset-ahead: Each entry measures how often its requests arrive, and
+   how long its VM takes to handle a request and to be reset. When the
+   reset would not be done before the next request, the entry keeps a
+   spare VM, which takes a request while the other one is still being
+   reset. Spares are only taken from VMs beyond one per thread. */
+static void sweep_slot_cache();
+struct StickySlot {
+	kvm::TenantInstance* tenant = nullptr;
+	kvm::VMPoolItem* slot = nullptr;
+	kvm::VMPoolItem* alternate_slot = nullptr;
+	std::weak_ptr<GuestResponseBody> pending_body;
+	std::weak_ptr<GuestResponseBody> alternate_pending_body;
+	uint64_t last_used = 0;
+	uint32_t hibernations = 0; /* Of the tenant, when the entry was taken */
+
+	/* The VM statistics last seen, to measure what changed since. */
+	struct Seen {
+		uint64_t resets = 0;
+		double   reset_time = 0.0;
+		double   request_time = 0.0;
+		static Seen of(const kvm::VMPoolItem* s) {
+			const auto& stats = s->mi->stats();
+			return { stats.resets, stats.vm_reset_time, stats.request_cpu_time };
+		}
+	} seen, alternate_seen;
+	double   ewma_interval = 0.0; /* Seconds between requests */
+	double   ewma_reset    = 0.0; /* Seconds to reset the VM */
+	double   ewma_request  = 0.0; /* Seconds to handle a request */
+	uint64_t last_arrival  = 0;
+	bool     has_spare     = false;
+
+	void swap()
+	{
+		std::swap(slot, alternate_slot);
+		std::swap(pending_body, alternate_pending_body);
+		std::swap(seen, alternate_seen);
+	}
+	static void release_vm(kvm::VMPoolItem* s, std::weak_ptr<GuestResponseBody>& pending)
+	{
+		reclaim_response_body(pending);
+		if (s == nullptr)
 			return;
+		if (s->task_future.valid())
+			s->task_future.get();
+		s->release();
+	}
+	void drop_spare()
+	{
+		release_vm(alternate_slot, alternate_pending_body);
+		alternate_slot = nullptr;
+		alternate_seen = {};
+		has_spare = false;
+		tenant->spare_vms.fetch_sub(1, std::memory_order_relaxed);
+	}
+	void evict()
+	{
+		if (has_spare)
+			tenant->spare_vms.fetch_sub(1, std::memory_order_relaxed);
+		release_vm(slot, pending_body);
+		release_vm(alternate_slot, alternate_pending_body);
+		*this = {};
+	}
+	/* The VMs of a hibernated program go back, so that it can be destroyed. */
+	bool hibernated() const noexcept {
+		return hibernations != tenant->hibernations.load(std::memory_order_relaxed);
+	}
+	/* Idle VMs of elastic pools go back, so that they can be released. */
+	bool idle(uint64_t now) const noexcept {
+		return tenant->config.group.is_elastic()
+			&& now - last_arrival > tenant->config.group.vm_idle_timeout * 1e9;
+	}
+	/* Under memory pressure, VMs that were not used since the last sweep
+	   go back, where the memory governor can trim them. */
+	bool unused(uint64_t now) const noexcept {
+		return now - last_arrival > kvm::SLOT_SWEEP_INTERVAL_MS * 1'000'000ull;
+	}
+	/* Measure the last request and reset of the VM that is now ready. */
+	void observe(const kvm::VMPoolItem* s)
+	{
+		static constexpr double ALPHA = 0.125;
+		const auto& stats = s->mi->stats();
+		if (stats.resets > seen.resets) {
+			const double reset = (stats.vm_reset_time - seen.reset_time) / (stats.resets - seen.resets);
+			ewma_reset += ALPHA * (reset - ewma_reset);
+		}
+		if (stats.request_cpu_time > seen.request_time) {
+			ewma_request += ALPHA * ((stats.request_cpu_time - seen.request_time) - ewma_request);
 		}
+		seen = Seen::of(s);
+	}
+	void arrival(uint64_t now)
+	{
+		static constexpr double ALPHA = 0.125;
+		if (last_arrival != 0)
+			ewma_interval += ALPHA * ((now - last_arrival) * 1e-9 - ewma_interval);
+		last_arrival = now;
+	}
+	/* A spare is needed when the reset does not fit between requests.
+	   It is dropped again when the reset fits twice over. */
+	bool wants_spare() const noexcept {
+		return ewma_reset > ewma_interval - ewma_request;
+	}
+	bool wants_no_spare() const noexcept {
+		return 2.0 * ewma_reset < ewma_interval - ewma_request;
+	}
+};
+struct SlotCache {
+	std::vector<StickySlot> entries;
+	uint64_t counter = 0;
+
+	StickySlot& get(kvm::TenantInstance& tenant, uint64_t now)
+	{
+		if (UNLIKELY(entries.empty())) {
+			entries.resize(std::max(1, g_settings.slot_cache_size));
+			/* A Drogon I/O thread sweeps from its loop, as it may see no
+			   more requests. Compute pool threads sweep when idle. */
+			if (auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread()) {
+				loop->runEvery(kvm::SLOT_SWEEP_INTERVAL_MS * 1e-3, sweep_slot_cache);
+			}
+		}
+		StickySlot* victim = &entries.front();
+		StickySlot* found = nullptr;
+		for (auto& entry : entries) {
+			if (entry.tenant != nullptr && entry.hibernated())
+				entry.evict();
+			if (entry.tenant == &tenant) {
+				found = &entry;
+				continue;
+			}
+			if (entry.tenant != nullptr && entry.idle(now))
+				entry.evict();
+			if (entry.last_used < victim->last_used)
+				victim = &entry;
+		}
+		if (found != nullptr) {
+			found->last_used = ++counter;
+			return *found;
+		}
+		if (victim->tenant != nullptr)
+			victim->evict();
+		victim->tenant = &tenant;
+		victim->hibernations = tenant.hibernations.load(std::memory_order_relaxed);
+		victim->last_used = ++counter;
+		return *victim;
+	}
+	/* Let go of the VMs of hibernated programs and idle elastic pools,
+	   which would otherwise wait for the next request on this thread.
+	   Under memory pressure, also of tenants without recent requests. */
+	void sweep(uint64_t now)
+	{
+		const bool pressure = kvm::MemoryGovernor::get().under_pressure();
+		for (auto& entry : entries) {
+			if (entry.tenant != nullptr && (entry.hibernated() || entry.idle(now)
+				|| (pressure && entry.unused(now))))
+				entry.evict();
+		}
+	}
+};
+static thread_local SlotCache slot_cache;
+/* The entry of the current request on this thread. */
+static thread_local StickySlot* sticky = nullptr;
+
+static void sweep_slot_cache()
+{
+	slot_cache.sweep(kvm::ScopedDuration<CLOCK_MONOTONIC>::nanos_now());
+}
+/* Called periodically by the threads that compute requests. */
+void kvm_sweep_slots()
+{
+	sweep_slot_cache();
+}
+
+static bool reset_done(kvm::VMPoolItem* slot)
+{
+	return !slot->task_future.valid()
+		|| slot->task_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+/* Take a spare VM for reset-ahead, if the tenant has one to spare. */
+static kvm::VMPoolItem* reserve_spare(kvm::TenantInstance& tenant)
+{
+	const int spares = int(tenant.config.group.max_concurrency) - g_settings.num_threads();
+	if (tenant.spare_vms.fetch_add(1, std::memory_order_relaxed) >= spares) {
+		tenant.spare_vms.fetch_sub(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	auto* spare = tenant.vmtryreserve();
+	if (spare == nullptr) {
+		tenant.spare_vms.fetch_sub(1, std::memory_order_relaxed);
+	}
+	return spare;
+}
+
+/* The priority of a request, from the tenants priority header, and how
+   long it can still wait for a VM before its queue time runs out. */
+static kvm::VMAdmission admission_for(kvm::TenantInstance& tenant, const HttpRequestPtr& req)
+{
+	const auto& group = tenant.config.group;
+	kvm::VMAdmission adm;
+	if (!group.priority_header.empty()) {
+		const std::string& value = req->getHeader(group.priority_header);
+		if (!value.empty()) {
+			const int prio = std::atoi(value.c_str());
+			adm.priority = std::clamp(prio, 0, kvm::VMAdmission::NUM_PRIORITIES - 1);
+		}
+	}
+	const int64_t age_us = trantor::Date::now().microSecondsSinceEpoch()
+		- req->creationDate().microSecondsSinceEpoch();
+	adm.budget = std::max(0.0f, group.max_queue_time - std::max<int64_t>(0, age_us) * 1e-6f);
+	return adm;
+}
+
+/* Reserve a VM from the tenant, or take a sticky VM of this thread.
+   Returns nullptr if no VM could be had. */
+static kvm::VMPoolItem* acquire_slot(kvm::TenantInstance& tenant, kvm::VMAdmission& adm)
+{
+	const uint64_t now = kvm::ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	// Keep the tenant from hibernating. Coarsely, as every thread writes it.
+	if (now > tenant.last_request.load(std::memory_order_relaxed) + 100'000'000) {
+		tenant.last_request.store(now, std::memory_order_relaxed);
+	}
+	if (g_settings.reservations) {
+		return tenant.vmreserve(false, &adm);
+	}
+	if (!uses_sticky_slot(tenant)) {
+		return tenant.vmborrow(&adm);
+	}
+	sticky = &slot_cache.get(tenant, now);
+	sticky->arrival(now);
+	// Use double-buffering to allow the previous request to be reset
+	// while we process the new request
+	if (g_settings.double_buffered) {
+		sticky->swap();
+	} else if (sticky->has_spare && sticky->slot != nullptr && !reset_done(sticky->slot)) {
+		// Reset-ahead: Use the spare while the other VM is being reset
+		if (reset_done(sticky->alternate_slot))
+			sticky->swap();
+	}
+	kvm::VMPoolItem* r_slot = sticky->slot;
+	if (UNLIKELY(r_slot == nullptr)) {
+		if (UNLIKELY((r_slot = tenant.vmreserve(false, &adm)) == nullptr)) {
+			return nullptr;
+		}
+		if (&tenant != &r_slot->mi->tenant()) {
+			throw std::runtime_error("Reserved VM from wrong tenant");
+		}
+		sticky->slot = r_slot;
+		sticky->seen = StickySlot::Seen::of(r_slot);
 	} else {
-		// Use double-buffering to allow the previous request to be reset
-		// while we process the new request
-		if (g_settings.double_buffered) {
-			std::swap(slot, alternate_slot);
+		reclaim_response_body(sticky->pending_body);
+		if (r_slot->task_future.valid())
+			r_slot->task_future.get();
+		sticky->observe(r_slot);
+	}
+
+	if (!g_settings.double_buffered) {
+		if (!sticky->has_spare && sticky->wants_spare()) {
+			if (auto* spare = reserve_spare(tenant)) {
+				sticky->alternate_slot = spare;
+				sticky->alternate_seen = StickySlot::Seen::of(spare);
+				sticky->has_spare = true;
+			}
+		} else if (sticky->has_spare && sticky->wants_no_spare()) {
+			sticky->drop_spare();
 		}
-		r_slot = slot;
-		if (UNLIKELY(r_slot == nullptr)) {
-			if (UNLIKELY((r_slot = tenant.vmreserve(false)) == nullptr)) {
+	}
+	return r_slot;
+}
+
+/* No VM could be had. Overloaded tenants tell the client when to retry. */
+static void respond_no_vm(const HttpResponsePtr& resp, const kvm::VMAdmission& adm)
+{
+	if (adm.retry_after > 0.0f) {
+		resp->setStatusCode(k503ServiceUnavailable);
+		resp->addHeader("Retry-After", std::to_string(std::max(1, int(std::ceil(adm.retry_after)))));
+	} else {
+		resp->setStatusCode(k500InternalServerError);
+	}
+}
+
+/* Hand requests to a program that waits for them in batches, with a
+   single VM entry for all of them. The requests are laid out one below
+   the other in the inputs area, and the batch is cut short when the
+   next request does not fit. Returns the number of requests handed
+   over, whose responses are then in the guest array batch.responses. */
+static size_t kvm_handle_batch(kvm::MachineInstance& inst,
+	const HttpRequestPtr* reqs, size_t count, bool warmup, backend_request_batch& batch)
+{
+	auto& vm = inst.machine();
+	/* Nothing has been handed over until the count is set below. */
+	batch.count = 0;
+	/* Scope: Regular CPU-time. */
+	kvm::ScopedDuration cputime(inst.stats().request_cpu_time);
+	inst.begin_call();
+
+	if (!inst.is_waiting_for_requests()) {
+		/* Run the VM until it halts again, and it should be waiting for requests. */
+		vm.run_in_usermode(1.0f);
+		if (!inst.is_waiting_for_requests()) {
+			throw std::runtime_error("VM did not wait for requests after request batch");
+		}
+	}
+	/* RDI is address of struct kvm_request_batch */
+	const uint64_t g_batch = vm.registers().rdi;
+	backend_request_batch guest_batch;
+	vm.copy_from_guest(&guest_batch, g_batch, sizeof(guest_batch));
+	batch.requests  = guest_batch.requests;
+	batch.responses = guest_batch.responses;
+	batch.max       = guest_batch.max;
+	const size_t max = std::min(count, size_t(inst.request_batch_max()));
+
+	thread_local std::array<backend_inputs, kvm::MAX_REQUEST_BATCH> inputs;
+	const bool eager_headers = inst.tenant().config.group.eager_headers;
+	const uint64_t bottom = backend_inputs_top(inst) - BACKEND_INPUTS_SIZE;
+	uint64_t top = backend_inputs_top(inst);
+	size_t n = 0;
+	for (; n < max; n++) {
+		const auto& req = reqs[n];
+		/* Only the first request may have its body in the POST area. */
+		if (n > 0 && backend_inputs_size(req, eager_headers) + req->body().size() + 16 > top - bottom)
+			break;
+		inputs[n] = {};
+		top = marshal_backend_inputs(inst, req, inputs[n], top, top - bottom);
+		inputs[n].info_flags = warmup ? 1 : 0;
+	}
+	vm.copy_to_guest(batch.requests, inputs.data(), n * sizeof(backend_inputs));
+	/* Responses left out by the program become errors. */
+	static const std::array<backend_batch_response, kvm::MAX_REQUEST_BATCH> no_responses {};
+	vm.copy_to_guest(batch.responses, no_responses.data(), n * sizeof(backend_batch_response));
+	batch.count = n;
+	vm.copy_to_guest(g_batch + offsetof(backend_request_batch, count), &batch.count, sizeof(batch.count));
+	inst.stats().invocations += n;
+
+	/* Resume execution, with time enough for every request. The
+	   program concludes the batch by waiting for the next one. */
+	inst.reset_wait_for_requests();
+	vm.vmresume(inst.tenant().config.max_req_time(false) * n);
+	if (UNLIKELY(!inst.is_waiting_for_requests())) {
+		throw std::runtime_error("VM did not wait for requests after request batch");
+	}
+	// Skip the OUT instruction (again)
+	auto& regs = vm.registers();
+	regs.rip += 2;
+	vm.set_registers(regs);
+	return n;
+}
+
+/* Compute the responses to a batch of requests in a VM that takes
+   batches, and then release the VM. Returns the number of requests
+   that got a response, which may be fewer than count. Responses are
+   cached and errors handled just like for single requests, but only
+   a batch of one has the header fields of its request (http_find()
+   and friends). Bigger batches only have the eager_headers fields. */
+static size_t kvm_compute_batched(kvm::TenantInstance& tenant, kvm::VMPoolItem* r_slot,
+	const HttpRequestPtr* reqs, HttpResponsePtr* resps, size_t count)
+{
+	kvm::MachineInstance* inst = r_slot->mi.get();
+	auto& vm = inst->machine();
+	tinykvm::ScopedProfiler<tinykvm::MachineProfiling::UserDefined> profiler(vm.profiling());
+	std::optional<DrogonHttpFields> http;
+	if (count == 1)
+		http.emplace(*inst, reqs[0]);
+	backend_request_batch batch {};
+	/* Responses that are complete, and kept should the batch fail. */
+	size_t done = 0;
+	std::string exception;
+	try {
+		size_t n;
+		if (g_settings.reservations) {
+			n = r_slot->run([inst, reqs, count, &batch] () -> long {
+				return kvm_handle_batch(*inst, reqs, count, false, batch);
+			});
+		} else {
+			n = kvm_handle_batch(*inst, reqs, count, false, batch);
+		}
+		if (UNLIKELY(vm.is_remote_connected())) {
+			throw std::runtime_error("Request batches cannot be concluded while remote-connected");
+		}
+
+		thread_local std::array<backend_batch_response, kvm::MAX_REQUEST_BATCH> responses;
+		vm.copy_from_guest(responses.data(), batch.responses, n * sizeof(backend_batch_response));
+		for (; done < n; done++) {
+			const auto& r = responses[done];
+			const auto& req = reqs[done];
+			auto& resp = resps[done];
+			const uint16_t status = r.status;
+			count_status(inst->stats(), status);
+			if (UNLIKELY(status == 0)) {
 				resp->setStatusCode(k500InternalServerError);
-				return;
+				continue;
 			}
-			if (tenant.config.group.max_concurrency < g_settings.num_threads()) {
-				// Limit the number of threads if max_concurrency is set
-				throw std::runtime_error("The tenant \"" + tenant.config.name + "\" has a max concurrency of " +
-					std::to_string(tenant.config.group.max_concurrency) + ", but the server is configured to use " +
-					std::to_string(g_settings.num_threads()) + " threads.");
+			std::string content_type = vm.buffer_to_string(r.ctype, uint16_t(r.ctype_len));
+			std::string body = vm.buffer_to_string(r.content, r.content_len);
+			DrogonHttpFields::header_list headers;
+			if (http.has_value())
+				headers = http->response_headers();
+			/* A batch of one may also use set_cacheable(). */
+			auto cacheable = inst->cacheable();
+			if (r.extra != 0x0) {
+				backend_response_extra extra;
+				vm.copy_from_guest(&extra, r.extra, sizeof(extra));
+				foreach_extra_header(vm, extra,
+				[&] (std::string_view key, std::string_view value) {
+					headers.emplace_back(key, value);
+				});
+				if (extra.cached)
+					cacheable = cacheable_from(extra);
 			}
-			slot = r_slot;
-		} else if (&tenant != &r_slot->mi->tenant()) {
-			if (r_slot->task_future.valid())
-				r_slot->task_future.get();
-			if (UNLIKELY((r_slot = tenant.vmreserve(false)) == nullptr)) {
-				resp->setStatusCode(k500InternalServerError);
-				return;
+			if (cacheable.cached && tenant.response_cache != nullptr && is_cacheable_request(req)) {
+				auto cached = std::make_shared<kvm::CachedResponse>();
+				cached->status = status;
+				cached->content_type = content_type;
+				cached->body = body;
+				cached->headers = headers;
+				tenant.response_cache->insert(cache_key(tenant, req), std::move(cached),
+					cacheable.ttl_ms, cacheable.grace_ms, cacheable.keep_ms);
 			}
-			if (&tenant != &r_slot->mi->tenant()) {
-				throw std::runtime_error("Reserved VM from wrong tenant");
+			resp->setStatusCode((drogon::HttpStatusCode)status);
+			resp->setContentTypeString(std::move(content_type));
+			resp->setBody(std::move(body));
+			for (auto& [key, value] : headers) {
+				resp->addHeader(std::move(key), std::move(value));
 			}
-			slot = r_slot;
-		} else {
-			if (r_slot->task_future.valid())
-				r_slot->task_future.get();
+		}
+		release_slot(r_slot);
+		return n;
+
+	} catch (const tinykvm::MachineTimeoutException& mte) {
+		fprintf(stderr, "%s: VM timed out (%f seconds)\n",
+			inst->name().c_str(), mte.seconds());
+		exception = mte.what();
+	} catch (const tinykvm::MachineException& e) {
+		fprintf(stderr, "%s: VM exception: %s (data: 0x%lX)\n",
+			inst->name().c_str(), e.what(), e.data());
+		exception = e.what();
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s: VM exception: %s\n",
+			inst->name().c_str(), e.what());
+		exception = e.what();
+	}
+	if (tenant.config.group.verbose) {
+		vm.print_registers();
+	}
+	inst->stats().exceptions ++;
+
+	/* Every request that was handed to the guest without a complete
+	   response fails, including the one being made. If the batch
+	   failed before any were handed over, the first request fails,
+	   so that the rest can be tried again. */
+	const size_t failed = std::max(size_t(batch.count), done + 1);
+	bool use_handler = true;
+	for (size_t i = done; i < failed; i++) {
+		use_handler = respond_with_error(tenant, r_slot, reqs[i], exception, resps[i],
+			http.has_value() ? &*http : nullptr, use_handler);
+	}
+	// Reset to known good state (which also disconnects remote)
+	inst->reset_needed_now();
+	release_slot(r_slot);
+	return failed;
+}
+
+void kvm_compute(kvm::TenantInstance& tenant,
+	const HttpRequestPtr& req, HttpResponsePtr& resp)
+{
+
+	/* Identical cacheable requests wait for the first one to finish,
+	   instead of each reserving a VM to compute the same response. */
+	CoalescedMiss coalesced;
+	if (auto* cache = tenant.response_cache.get();
+		cache != nullptr && tenant.config.group.cache_coalesce_wait > 0.0f && is_cacheable_request(req))
+	{
+		std::string key = cache_key(tenant, req);
+		const std::chrono::milliseconds max_wait(
+			int64_t(tenant.config.group.cache_coalesce_wait * 1000.0f));
+		kvm::ResponseCache::response_ptr cached;
+		switch (cache->coalesce(key, max_wait, cached)) {
+		case kvm::ResponseCache::Coalesce::First:
+			coalesced.cache = cache;
+			coalesced.key = std::move(key);
+			break;
+		case kvm::ResponseCache::Coalesce::Response:
+			set_cached_response(resp, *cached);
+			return;
+		case kvm::ResponseCache::Coalesce::Proceed:
+			break;
 		}
 	}
 
+	kvm::VMAdmission adm = admission_for(tenant, req);
+	kvm::VMPoolItem* r_slot = acquire_slot(tenant, adm);
+	if (UNLIKELY(r_slot == nullptr)) {
+		respond_no_vm(resp, adm);
+		return;
+	}
+
 	kvm::MachineInstance* inst = r_slot->mi.get();
+	/* Programs that take batches of requests get a batch of one. */
+	if (inst->request_batch_max() > 0) {
+		kvm_compute_batched(tenant, r_slot, &req, &resp, 1);
+		return;
+	}
 	tinykvm::ScopedProfiler<tinykvm::MachineProfiling::UserDefined> profiler(inst->machine().profiling());
+	std::string exception;
+	DrogonHttpFields http(*inst, req);
+	/* A body sent from guest memory owns the VM once handed off. */
+	std::shared_ptr<GuestResponseBody> body;
 	try {
 		if (g_settings.reservations)
 		{
-			r_slot->tp.enqueue([inst, &req] () -> long {
+			r_slot->run([inst, &req] () -> long {
 				kvm_handle_request(*inst, req, inst->tenant().config.group.ephemeral, false);
 				return 0;
-			}).get();
+			});
 		} else {
 			kvm_handle_request(*inst, req, inst->tenant().config.group.ephemeral, false);
 		}
@@ -298,38 +1318,113 @@ void kvm_compute(kvm::TenantInstance& tenant,
 			resp_inst = &resp_inst->program().storage().front_storage();
 		}
 
-		if (UNLIKELY(!resp_inst->response_called(1))) {
+		const bool streaming = resp_inst->response_called(10);
+		if (UNLIKELY(!resp_inst->response_called(1) && !streaming)) {
 			throw std::runtime_error("HTTP response not set. Program crashed? Check logs!");
 		}
 
 		/* VM registers with 5 arguments */
 		auto& regs = vm.registers();
 
-		/* Get content-type and data */
+		/* Get content-type and data (or content-length, when streaming) */
 		const uint16_t status = regs.rdi;
 		const uint64_t tvaddr = regs.rsi;
 		const uint16_t tlen   = regs.rdx;
 		const uint64_t cvaddr = regs.rcx;
-		const uint64_t clen   = regs.r8;
-
-		/* Status code statistics */
-		if (LIKELY(status >= 200 && status < 300)) {
-			resp_inst->stats().status_2xx++;
-		} else if (UNLIKELY(status < 200)) {
-			resp_inst->stats().status_unknown ++;
-		} else if (status < 400) {
-			resp_inst->stats().status_3xx++;
-		} else if (status < 500) {
-			resp_inst->stats().status_4xx++;
-		} else if (status < 600) {
-			resp_inst->stats().status_5xx++;
+		const uint64_t clen   = streaming ? regs.rcx : regs.r8;
+
+		count_status(resp_inst->stats(), status);
+		/* Streaming responses pull the body out of a guest callback,
+		   as the socket drains. The guest never returns from
+		   begin_streaming_response(), so the VM must be reset after. */
+		if (streaming) {
+			if (UNLIKELY(vm.is_remote_connected())) {
+				throw std::runtime_error("Streaming responses cannot be made while remote-connected");
+			}
+			const uint64_t stream_func = regs.r8;
+			const uint64_t stream_arg  = regs.r9;
+			const uint64_t stack = (regs.rsp - 128UL) & ~0xFUL;
+			if (!inst->is_ephemeral()) {
+				inst->reset_needed_now();
+			}
+			std::string content_type = vm.buffer_to_string(tvaddr, tlen);
+			body = std::make_shared<GuestResponseBody>(r_slot, stream_func, stream_arg, clen, stack);
+			resp = HttpResponse::newStreamResponse(
+			[body] (char* buffer, size_t len) -> size_t {
+				if (buffer == nullptr) {
+					body->release();
+					return 0;
+				}
+				return body->read(buffer, len);
+			});
+			resp->setStatusCode((drogon::HttpStatusCode)status);
+			resp->setContentTypeString(std::move(content_type));
+			http.apply(resp);
+			set_pending_body(uses_sticky_slot(tenant) ? &sticky->pending_body : nullptr, body);
+			return;
+		}
+
+		/* Set response. Large bodies are sent directly from guest memory,
+		   which keeps the VM from being reset until the body is written.
+		   Bodies from remote VMs are gone once the remote disconnects.
+		   Cacheable bodies are always copied, as they outlive the VM. */
+		std::string content_type = vm.buffer_to_string(tvaddr, tlen);
+		backend_response_extra extra {};
+		if (regs.r9 != 0x0) {
+			vm.copy_from_guest(&extra, regs.r9, sizeof(extra));
+			if (extra.cached && tenant.response_cache != nullptr) {
+				inst->set_cacheable(cacheable_from(extra));
+			}
+		}
+		/* Extra header fields come from the guest and may be invalid,
+		   so they are read before the body takes ownership of the VM. */
+		std::vector<std::pair<std::string, std::string>> extra_headers;
+		foreach_extra_header(vm, extra,
+		[&] (std::string_view key, std::string_view value) {
+			extra_headers.emplace_back(key, value);
+		});
+		const auto& cacheable = inst->cacheable();
+		const bool cache_insert = cacheable.cached
+			&& tenant.response_cache != nullptr && is_cacheable_request(req);
+		const bool zero_copy = clen >= kvm_settings.backend_early_release_size
+			&& !vm.is_remote_connected() && !cache_insert;
+		std::shared_ptr<kvm::CachedResponse> cached;
+		if (zero_copy) {
+			body = std::make_shared<GuestResponseBody>(r_slot, vm, cvaddr, clen);
+			resp = HttpResponse::newStreamResponse(
+			[body] (char* buffer, size_t len) -> size_t {
+				/* A null buffer means the stream is done (or interrupted). */
+				if (buffer == nullptr) {
+					body->release();
+					return 0;
+				}
+				return body->read(buffer, len);
+			});
+			/* The length is known, so the body is not sent chunked,
+			   just as it would be when copied out of the VM. */
+			resp->addHeader("Content-Length", std::to_string(clen));
+		} else if (cache_insert) {
+			cached = std::make_shared<kvm::CachedResponse>();
+			cached->status = status;
+			cached->content_type = content_type;
+			cached->body = vm.buffer_to_string(cvaddr, clen);
+			cached->headers = http.response_headers();
+			resp->setBody(cached->body);
 		} else {
-			resp_inst->stats().status_unknown++;
+			resp->setBody(vm.buffer_to_string(cvaddr, clen));
 		}
-		/* Set response */
 		resp->setStatusCode((drogon::HttpStatusCode)status);
-		resp->setContentTypeString(vm.buffer_to_string(tvaddr, tlen));
-		resp->setBody(vm.buffer_to_string(cvaddr, clen));
+		resp->setContentTypeString(std::move(content_type));
+		http.apply(resp);
+		for (auto& [key, value] : extra_headers) {
+			if (cached != nullptr)
+				cached->headers.emplace_back(key, value);
+			resp->addHeader(std::move(key), std::move(value));
+		}
+		if (cached != nullptr) {
+			tenant.response_cache->insert(cache_key(tenant, req), std::move(cached),
+				cacheable.ttl_ms, cacheable.grace_ms, cacheable.keep_ms);
+		}
 
 		/* Disconnect from the remote, if it's still connected */
 		if (vm.is_remote_connected()) {
@@ -343,34 +1438,76 @@ void kvm_compute(kvm::TenantInstance& tenant,
 			}
 		}
 
-		if (g_settings.reservations) {
-			kvm::ProgramInstance::vm_free_function(r_slot);
-		} else {
-			r_slot->deferred_reset();
+		/* The VM is released once the body has been written. */
+		if (zero_copy) {
+			set_pending_body(uses_sticky_slot(tenant) ? &sticky->pending_body : nullptr, body);
+			return;
 		}
+		release_slot(r_slot);
 		return;
 
 	} catch (const tinykvm::MachineTimeoutException& mte) {
 		fprintf(stderr, "%s: VM timed out (%f seconds)\n",
 			inst->name().c_str(), mte.seconds());
-		inst->machine().print_registers();
+		exception = mte.what();
 	} catch (const tinykvm::MachineException& e) {
 		fprintf(stderr, "%s: VM exception: %s (data: 0x%lX)\n",
 			inst->name().c_str(), e.what(), e.data());
-		inst->machine().print_registers();
+		exception = e.what();
 	} catch (const std::exception& e) {
-		fprintf(stderr, "VM exception: %s\n", e.what());
+		fprintf(stderr, "%s: VM exception: %s\n",
+			inst->name().c_str(), e.what());
+		exception = e.what();
+	}
+	/* The VM is released below, exactly once, and the error response
+	   must not be the body that was taken from the VM. */
+	if (body != nullptr) {
+		body->disown();
+		resp = HttpResponse::newHttpResponse();
+	}
+	if (tenant.config.group.verbose) {
 		inst->machine().print_registers();
 	}
-	resp->setStatusCode(k500InternalServerError);
 	inst->stats().exceptions ++;
+
+	respond_with_error(tenant, r_slot, req, exception, resp, &http, true);
+
 	// Reset to known good state (which also disconnects remote)
 	inst->reset_needed_now();
-	if (g_settings.reservations) {
-		kvm::ProgramInstance::vm_free_function(r_slot);
-	} else {
-		r_slot->reset();
-		slot = nullptr;
+	release_slot(r_slot);
+}
+
+/* Compute the responses to several requests for the same tenant. A
+   program that takes batches of requests is handed as many as it can
+   take per VM entry, and other programs get them one by one.
+   The first done responses are complete, also when this throws. */
+void kvm_compute_batch(kvm::TenantInstance& tenant,
+	const HttpRequestPtr* reqs, HttpResponsePtr* resps, size_t count, size_t& done)
+{
+	done = 0;
+	auto prog = std::atomic_load(&tenant.program);
+	if (prog == nullptr || !prog->is_initialized() || prog->main_vm->request_batch_max() == 0) {
+		for (; done < count; done++)
+			kvm_compute(tenant, reqs[done], resps[done]);
+		return;
+	}
+	while (done < count) {
+		kvm::VMAdmission adm = admission_for(tenant, reqs[done]);
+		kvm::VMPoolItem* r_slot = acquire_slot(tenant, adm);
+		if (UNLIKELY(r_slot == nullptr)) {
+			for (; done < count; done++)
+				respond_no_vm(resps[done], adm);
+			return;
+		}
+		if (UNLIKELY(r_slot->mi->request_batch_max() == 0)) {
+			/* The program was live-updated to one without batches. */
+			if (!uses_sticky_slot(tenant))
+				release_slot(r_slot);
+			for (; done < count; done++)
+				kvm_compute(tenant, reqs[done], resps[done]);
+			return;
+		}
+		done += kvm_compute_batched(tenant, r_slot, reqs + done, resps + done, count - done);
 	}
 }
 
@@ -412,7 +1549,12 @@ void kvm_handle_warmup(kvm::MachineInstance& inst, const kvm::TenantGroup::Warmu
 	for (int i = 0;; i++) {
 		{
 			tinykvm::ScopedProfiler<tinykvm::MachineProfiling::UserDefined> reqtime(vm.profiling());
-			kvm_handle_request(inst, req, false, true);
+			if (inst.request_batch_max() > 0) {
+				backend_request_batch batch;
+				kvm_handle_batch(inst, &req, 1, true, batch);
+			} else {
+				kvm_handle_request(inst, req, false, true);
+			}
 		}
 		/* Check if this was an improvement */
 		if (const auto* profiler = vm.profiling(); profiler != nullptr) {
@@ -441,6 +1583,11 @@ void kvm_handle_warmup(kvm::MachineInstance& inst, const kvm::TenantGroup::Warmu
 		vm.set_profiling(false);
 	}
 
+	/* Batched programs are already waiting for the next batch. */
+	if (inst.request_batch_max() > 0) {
+		return;
+	}
+
 	/* Run the VM until it halts again, and it should be waiting for requests. */
 	vm.run_in_usermode(1.0f);
 	if (!inst.is_waiting_for_requests()) {
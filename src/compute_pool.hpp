@@ -0,0 +1,61 @@
+#pragma once
+#include <blockingconcurrentqueue.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/**
+ * ComputePool is a fixed set of worker threads that run VM requests
+ * on behalf of the Drogon I/O loops. In asynchronous mode the I/O
+ * loops only parse requests and write responses, while the workers
+ * own the VMs (and their thread-local slots). A slow tenant can then
+ * only hold up a worker, and never the other connections on a loop.
+ *
+ * Each worker also calls tick (if any) every interval, between tasks,
+ * so that it can let go of what its thread-local slots hold.
+**/
+struct ComputePool {
+	using Task = std::function<void()>;
+
+	ComputePool(unsigned num_workers, Task tick = {},
+		std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+	{
+		m_workers.reserve(num_workers);
+		for (unsigned i = 0; i < num_workers; i++) {
+			m_workers.emplace_back([this, tick, interval] {
+				using clock = std::chrono::steady_clock;
+				auto next_tick = clock::now() + interval;
+				Task task;
+				for (;;) {
+					if (m_queue.wait_dequeue_timed(task, interval)) {
+						if (!task)
+							return;
+						task();
+					}
+					if (tick && clock::now() >= next_tick) {
+						tick();
+						next_tick = clock::now() + interval;
+					}
+				}
+			});
+		}
+	}
+	~ComputePool()
+	{
+		/* An empty task tells a worker to stop. */
+		for (size_t i = 0; i < m_workers.size(); i++)
+			m_queue.enqueue(Task{});
+		for (auto& worker : m_workers)
+			worker.join();
+	}
+
+	void enqueue(Task task) {
+		m_queue.enqueue(std::move(task));
+	}
+	size_t size() const noexcept { return m_workers.size(); }
+
+private:
+	moodycamel::BlockingConcurrentQueue<Task> m_queue;
+	std::vector<std::thread> m_workers;
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <tinykvm/machine.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include "sandbox/common_defs.hpp"
+
+/**
+ * GuestWriter writes sequentially into a range of guest memory using
+ * host pointers that were gathered once up front, with
+ * Machine::writable_buffers_from_range(). The range is typically
+ * made up of a handful of page-sized buffers, and the writer simply
+ * walks them in order. Several writers can share the same buffers,
+ * each with its own cursor, so that a structure and the strings it
+ * points to can be laid out in a single pass.
+**/
+struct GuestWriter {
+	using WrBuffer = tinykvm::Machine::WrBuffer;
+
+	GuestWriter(const std::vector<WrBuffer>& buffers, uint64_t gaddr, size_t offset = 0)
+		: m_buffers(buffers), m_gaddr(gaddr)
+	{
+		this->skip(offset);
+	}
+
+	/* The guest address of the next byte to be written. */
+	uint64_t address() const noexcept { return m_gaddr; }
+
+	/* Write bytes and return the guest address of the first one. */
+	uint64_t write(const void* src, size_t len)
+	{
+		const uint64_t gaddr = m_gaddr;
+		const char* data = (const char *)src;
+		while (len > 0) {
+			if (UNLIKELY(m_idx >= m_buffers.size()))
+				throw std::runtime_error("GuestWriter: Out of guest buffer space");
+			auto& buf = m_buffers[m_idx];
+			const size_t n = std::min(len, buf.len - m_off);
+			std::memcpy(buf.ptr + m_off, data, n);
+			data += n;
+			len  -= n;
+			this->advance(n);
+		}
+		return gaddr;
+	}
+	uint64_t write(std::string_view str) {
+		return this->write(str.data(), str.size());
+	}
+	/* Write a string followed by a zero terminator. */
+	uint64_t write_cstr(std::string_view str) {
+		const uint64_t gaddr = this->write(str.data(), str.size());
+		this->write("", 1);
+		return gaddr;
+	}
+
+	void skip(size_t len)
+	{
+		while (len > 0) {
+			if (UNLIKELY(m_idx >= m_buffers.size()))
+				throw std::runtime_error("GuestWriter: Out of guest buffer space");
+			const size_t n = std::min(len, m_buffers[m_idx].len - m_off);
+			len -= n;
+			this->advance(n);
+		}
+	}
+
+private:
+	void advance(size_t n) {
+		m_gaddr += n;
+		m_off   += n;
+		if (m_off == m_buffers[m_idx].len) {
+			m_idx ++;
+			m_off = 0;
+		}
+	}
+
+	const std::vector<WrBuffer>& m_buffers;
+	uint64_t m_gaddr;
+	size_t   m_idx = 0;
+	size_t   m_off = 0;
+};
@@ -1,11 +1,22 @@
 #include <drogon/drogon.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include "sandbox/memory_governor.hpp"
+#include "sandbox/settings.hpp"
 #include "sandbox/tenants.hpp"
+#include "compute_pool.hpp"
 #include "settings.hpp"
 Settings g_settings;
 using namespace drogon;
 
 extern void kvm_compute(kvm::TenantInstance& tenant,
 	const HttpRequestPtr& req, HttpResponsePtr& resp);
+extern void kvm_compute_batch(kvm::TenantInstance& tenant,
+	const HttpRequestPtr* reqs, HttpResponsePtr* resps, size_t count, size_t& done);
+extern void kvm_sweep_slots();
+extern bool kvm_cache_lookup(kvm::TenantInstance& tenant,
+	const HttpRequestPtr& req, HttpResponsePtr& resp);
 
 static void usage(const char* progname)
 {
@@ -13,6 +24,7 @@ static void usage(const char* progname)
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  --reservations|-r    Enable reservations\n");
 	fprintf(stderr, "  --concurrency|-c <n> Set concurrent VMs per tenant\n");
+	fprintf(stderr, "  --threads <n>        Set request threads with reservations (default: 160)\n");
 	fprintf(stderr, "  --config <file>      Specify JSON configuration file (default: tenants.json)\n");
 	fprintf(stderr, "  --default|-d         Set default tenant (default: test.com)\n");
 	fprintf(stderr, "  --debug-boot         Start remote GDB at boot\n");
@@ -20,9 +32,14 @@ static void usage(const char* progname)
 	fprintf(stderr, "  --ephemeral|-e       Enable ephemeral VMs (default: true)\n");
 	fprintf(stderr, "  --no-ephemeral       Disable ephemeral VMs\n");
 	fprintf(stderr, "  --double-buffered    Enable double-buffered VM resets (default: false)\n");
+	fprintf(stderr, "  --lazy-forking       Fork request VMs on demand, starting with one (default: false)\n");
 	fprintf(stderr, "  --profiling|-p       Enable profiling (default: false)\n");
 	fprintf(stderr, "  --snapshot-mode      Set snapshot profiling mode (none, accessed, reorder)\n");
 	fprintf(stderr, "  --port <n>           Set listening port (default: 8080)\n");
+	fprintf(stderr, "  --io-threads <n>     Handle requests asynchronously with n I/O threads\n");
+	fprintf(stderr, "  --max-body-size <n>  Set max request body size in MiB (default: 1)\n");
+	fprintf(stderr, "  --slot-cache <n>     Keep VMs for n tenants per thread (default: 4)\n");
+	fprintf(stderr, "  --memory-budget <n>  Keep VM memory within n MiB, reclaiming under pressure (default: unlimited)\n");
 	fprintf(stderr, "  --verbose|-v         Enable verbose output (default: false)\n");
 	fprintf(stderr, "  --help               Show this help message\n");
 	exit(1);
@@ -51,6 +68,10 @@ static void init_settings(int argc, char** argv)
 			if (i + 1 < argc) {
 				g_settings.concurrency = std::stoi(argv[++i]);
 			}
+		} else if (arg == "--threads") {
+			if (i + 1 < argc) {
+				g_settings.reservation_threads = std::stoi(argv[++i]);
+			}
 		} else if (arg == "--debug-boot") {
 			g_settings.debug_boot = true;
 		} else if (arg == "--debug-prefork") {
@@ -61,12 +82,30 @@ static void init_settings(int argc, char** argv)
 			g_settings.ephemeral = false;
 		} else if (arg == "--double-buffered") {
 			g_settings.double_buffered = true;
+		} else if (arg == "--lazy-forking") {
+			g_settings.lazy_forking = true;
 		} else if (arg == "--profiling" || arg == "-p") {
 			g_settings.profiling = true;
 		} else if (arg == "--port") {
 			if (i + 1 < argc) {
 				g_settings.port = std::stoi(argv[++i]);
 			}
+		} else if (arg == "--io-threads") {
+			if (i + 1 < argc) {
+				g_settings.io_threads = std::stoi(argv[++i]);
+			}
+		} else if (arg == "--slot-cache") {
+			if (i + 1 < argc) {
+				g_settings.slot_cache_size = std::stoi(argv[++i]);
+			}
+		} else if (arg == "--memory-budget") {
+			if (i + 1 < argc) {
+				g_settings.vm_memory_budget = std::stoul(argv[++i]);
+			}
+		} else if (arg == "--max-body-size") {
+			if (i + 1 < argc) {
+				g_settings.max_body_size = std::stoul(argv[++i]) << 20;
+			}
 		} else if (arg == "--snapshot-mode") {
 			if (i + 1 < argc) {
 				std::string mode = argv[++i];
@@ -96,12 +135,115 @@ static void init_settings(int argc, char** argv)
 }
 
 static kvm::Tenants tenants;
+
+/* Answer requests that don't need a VM, and find the tenant
+   for the rest. Returns nullptr when the response is complete. */
+static kvm::TenantInstance* route_request(const HttpRequestPtr& req, HttpResponsePtr& resp)
+{
+	const auto& path = req->path();
+	if (path == "/drogon")
+	{
+		resp->setBody("Hello World!");
+		resp->setContentTypeCode(CT_TEXT_PLAIN);
+	}
+	else if (path == "/stats")
+	{
+		nlohmann::json j;
+		tenants.foreach([&] (auto* tenant) {
+			tenant->gather_stats(j);
+		});
+		kvm::MemoryGovernor::get().gather_stats(j["memory_governor"]);
+
+		resp->setBody(j.dump());
+		resp->setContentTypeCode(CT_APPLICATION_JSON);
+	}
+	else
+	{
+		const auto& host = req->getHeader("Host");
+		if (auto* tenant = tenants.route(host, path); LIKELY(tenant != nullptr)) {
+			return tenant;
+		}
+		else {
+			resp->setBody("No such tenant: " + host);
+			resp->setStatusCode(k500InternalServerError);
+		}
+	}
+	return nullptr;
+}
+
+/* Requests waiting for a VM worker, in asynchronous mode. A worker
+   takes its share of the queue at once, and requests for the same
+   tenant are computed together, so that programs that take batches
+   of requests can handle several of them per VM entry. */
+struct PendingRequest {
+	kvm::TenantInstance* tenant;
+	HttpRequestPtr  req;
+	HttpResponsePtr resp;
+	AdviceCallback  callback;
+	trantor::EventLoop* loop;
+};
+static std::mutex pending_mtx;
+static std::deque<PendingRequest> pending_requests;
+
+static void compute_pending_requests()
+{
+	thread_local std::vector<PendingRequest> batch;
+	thread_local std::vector<HttpRequestPtr>  reqs;
+	thread_local std::vector<HttpResponsePtr> resps;
+	{
+		std::lock_guard<std::mutex> lock(pending_mtx);
+		/* Leave enough for the other workers to stay busy. */
+		size_t share = pending_requests.size() / g_settings.num_threads() + 1;
+		share = std::min({share, pending_requests.size(), size_t(kvm::MAX_REQUEST_BATCH)});
+		for (size_t i = 0; i < share; i++) {
+			batch.push_back(std::move(pending_requests.front()));
+			pending_requests.pop_front();
+		}
+	}
+	/* Group by tenant, keeping the order of each tenants requests. */
+	std::stable_sort(batch.begin(), batch.end(),
+		[] (const PendingRequest& a, const PendingRequest& b) { return a.tenant < b.tenant; });
+
+	for (size_t i = 0; i < batch.size(); ) {
+		size_t end = i;
+		for (; end < batch.size() && batch[end].tenant == batch[i].tenant; end++) {
+			reqs.push_back(std::move(batch[end].req));
+			resps.push_back(std::move(batch[end].resp));
+		}
+		size_t done = 0;
+		try {
+			kvm_compute_batch(*batch[i].tenant, reqs.data(), resps.data(), reqs.size(), done);
+		} catch (const std::exception& e) {
+			fprintf(stderr, "kvm: Request exception: %s\n", e.what());
+			/* Responses completed before the failure are kept. */
+			for (size_t j = done; j < resps.size(); j++) {
+				resps[j] = HttpResponse::newHttpResponse();
+				resps[j]->setStatusCode(k500InternalServerError);
+			}
+		}
+		for (size_t j = i; j < end; j++) {
+			batch[j].loop->queueInLoop(
+			[callback = std::move(batch[j].callback), resp = std::move(resps[j - i])] {
+				callback(resp);
+			});
+		}
+		reqs.clear();
+		resps.clear();
+		i = end;
+	}
+	batch.clear();
+}
+
 int main(int argc, char** argv)
 {
 	init_settings(argc, argv);
 	tenants.init(g_settings.json, false);
 
-	printf("* Reservations: %s\n", g_settings.reservations ? "enabled" : "disabled");
+	if (g_settings.reservations) {
+		printf("* Reservations: enabled, %d request threads\n", g_settings.num_threads());
+	} else {
+		printf("* Reservations: disabled\n");
+	}
 	printf("* JSON config file: %s\n", g_settings.json.c_str());
 	printf("* Default tenant: %s\n", g_settings.default_tenant.c_str());
 	printf("* Ephemeral VMs: %s\n", g_settings.ephemeral ? "enabled" : "disabled");
@@ -111,57 +253,64 @@ int main(int argc, char** argv)
 	} else {
 		printf("* Tenant concurrency: hardware specified (%u)%s\n", std::thread::hardware_concurrency(), dbs);
 	}
+	if (g_settings.async()) {
+		printf("* Asynchronous requests: %d I/O threads, %d VM workers\n",
+			g_settings.num_io_threads(), g_settings.num_threads());
+	}
 
 	kvm::TenantInstance::set_logger([] (auto* tenant, auto stuff) {
 		LOG_WARN << "[" << tenant->config.name << "] " << stuff;
 	});
-	static auto* default_tenant = tenants.find(g_settings.default_tenant);
-	if (default_tenant == nullptr) {
+	if (tenants.find(g_settings.default_tenant) == nullptr) {
 		fprintf(stderr, "kvm: Default tenant '%s' not found\n",
 			g_settings.default_tenant.c_str());
 		return 1;
 	}
-	static const std::string DEFAULT_HOST = g_settings.host + ":" + std::to_string(g_settings.port);
 
 	app().setLogPath("./")
 		.setLogLevel(trantor::Logger::kWarn)
 		.addListener(g_settings.host, g_settings.port)
-		.setThreadNum(g_settings.num_threads())
-		.registerSyncAdvice(
+		.setThreadNum(g_settings.num_io_threads())
+		.setClientMaxBodySize(g_settings.max_body_size);
+
+	static std::unique_ptr<ComputePool> compute_pool;
+	if (!g_settings.async())
+	{
+		app().registerSyncAdvice(
 		[] (const HttpRequestPtr& req) -> HttpResponsePtr {
 			auto resp = HttpResponse::newHttpResponse();
-			const auto& path = req->path();
-			if (path == "/drogon")
-			{
-				resp->setBody("Hello World!");
-				resp->setContentTypeCode(CT_TEXT_PLAIN);
+			if (auto* tenant = route_request(req, resp)) {
+				if (!kvm_cache_lookup(*tenant, req, resp))
+					kvm_compute(*tenant, req, resp);
 			}
-			else if (path == "/stats")
-			{
-				nlohmann::json j;
-				tenants.foreach([&] (auto* tenant) {
-					tenant->gather_stats(j);
-				});
-
-				resp->setBody(j.dump());
-				resp->setContentTypeCode(CT_APPLICATION_JSON);
+			return resp;
+		});
+	}
+	else
+	{
+		/* Hand VM requests to the compute pool, and complete them
+		   back on the event loop that owns the connection. Each
+		   request queues one task, which may find that another
+		   worker already took the request along with its own. */
+		compute_pool = std::make_unique<ComputePool>(g_settings.num_threads(),
+			kvm_sweep_slots, std::chrono::milliseconds(kvm::SLOT_SWEEP_INTERVAL_MS));
+		app().registerPreRoutingAdvice(
+		[] (const HttpRequestPtr& req, AdviceCallback&& callback, AdviceChainCallback&&) {
+			auto resp = HttpResponse::newHttpResponse();
+			auto* tenant = route_request(req, resp);
+			if (tenant == nullptr || kvm_cache_lookup(*tenant, req, resp)) {
+				callback(resp);
+				return;
 			}
-			else
+			auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
 			{
-				const auto& host = req->getHeader("Host");
-				if (auto* tenant = tenants.find(host); LIKELY(tenant != nullptr)) {
-					kvm_compute(*tenant, req, resp);
-				}
-				else if (host == DEFAULT_HOST) {
-					kvm_compute(*default_tenant, req, resp);
-				}
-				else {
-					resp->setBody("No such tenant: " + host);
-					resp->setStatusCode(k500InternalServerError);
-				}
+				std::lock_guard<std::mutex> lock(pending_mtx);
+				pending_requests.push_back(PendingRequest{
+					tenant, req, std::move(resp), std::move(callback), loop});
 			}
-			return resp;
+			compute_pool->enqueue(compute_pending_requests);
 		});
+	}
 	uint64_t rss = 0;
 	FILE *f = fopen("/proc/self/statm", "r");
 	if (f) {
@@ -174,6 +323,6 @@ int main(int argc, char** argv)
 	printf("* Server started on %s:%d (RSS: %lu MiB, threads: %d)\n",
 		g_settings.host.c_str(), g_settings.port,
 		rss,
-		g_settings.num_threads());
+		g_settings.num_io_threads());
 	app().run();
 }
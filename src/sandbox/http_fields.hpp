@@ -0,0 +1,48 @@
+#pragma once
+#include <string_view>
+
+namespace kvm {
+
+/**
+ * HttpFields gives the HTTP system calls access to the request that a
+ * VM is currently handling, and to the headers of its response. It is
+ * implemented by the HTTP server, and is only set for the duration of
+ * a request. With it, a program can look up the few header fields it
+ * needs instead of having every field copied into the guest up front.
+**/
+struct HttpFields {
+	static constexpr int REQ  = 0;
+	static constexpr int RESP = 1;
+
+	/* Find the value of a header field by (case-insensitive) key. */
+	virtual bool find(int where, std::string_view key, std::string_view& value) = 0;
+	/* Set or overwrite a header field. */
+	virtual bool set(int where, std::string_view key, std::string_view value) = 0;
+	/* Add a header field, even if one with the same key already exists. */
+	virtual bool append(int where, std::string_view key, std::string_view value) = 0;
+	/* Remove all header fields with the given key. */
+	virtual bool unset(int where, std::string_view key) = 0;
+	/* The request method, eg. GET or POST. */
+	virtual std::string_view method() const = 0;
+
+	/* Split "Key: Value" into its key and value. Returns false
+	   when there is no colon, in which case key is the whole field. */
+	static bool split_field(std::string_view field, std::string_view& key, std::string_view& value)
+	{
+		const auto colon = field.find(':');
+		if (colon == std::string_view::npos) {
+			key = field;
+			value = {};
+			return false;
+		}
+		key = field.substr(0, colon);
+		value = field.substr(colon + 1);
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+			value.remove_prefix(1);
+		return true;
+	}
+
+	virtual ~HttpFields() = default;
+};
+
+} // kvm
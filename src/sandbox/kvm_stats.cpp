@@ -70,14 +70,29 @@ void TenantInstance::gather_stats(nlohmann::json& j)
 	else
 		prog = std::atomic_load(&this->debug_program);
 
-	/* Don't gather stats for missing programs. */
-	if (prog == nullptr) {
+	/* Don't gather stats for missing programs, except hibernated ones. */
+	const uint32_t num_resurrections = this->resurrections.load();
+	if (prog == nullptr && this->hibernations.load() == 0) {
 		return;
 	}
 
 	/* JSON object root uses program name. */
 	auto& obj = j[this->config.name];
 
+	if (this->config.group.hibernate_after > 0.0f || this->hibernations.load() > 0) {
+		obj["hibernation"] = {
+			{"hibernated",    prog == nullptr},
+			{"hibernations",  this->hibernations.load()},
+			{"resurrections", num_resurrections},
+			{"resurrection_time", this->resurrection_ns.load() * 1e-9},
+			{"resurrection_time_avg", num_resurrections > 0
+				? this->resurrection_ns_total.load() * 1e-9 / num_resurrections : 0.0}
+		};
+	}
+	if (prog == nullptr) {
+		return;
+	}
+
 	/* Storage VM */
 	if (prog->has_storage())
 	{
@@ -123,20 +138,28 @@ void TenantInstance::gather_stats(nlohmann::json& j)
 	MachineStats totals {};
 	auto machines = json::array();
 	const size_t num_machines = prog->m_vms.size();
+	/* Elastic pools fork and release VMs while we look at them. */
+	std::unique_lock<std::mutex> vms_lock(prog->m_vms_mtx);
+	const size_t active_machines = prog->m_active_vms;
 	std::vector<uint64_t> reqid_requests;
 
 	/* Individual request VMs */
 	uint64_t total_remote_calls = 0;
+	uint64_t total_banked = 0;
 	for (size_t i = 0; i < prog->m_vms.size(); i++)
 	{
+		if (prog->m_vms[i].mi == nullptr)
+			continue;
 		auto& mi = *prog->m_vms[i].mi;
-		machines.push_back(kvm::gather_stats(mi, prog->m_vms[i].tp));
+		machines.push_back(kvm::gather_stats(mi, prog->m_vms[i].worker));
 
 		/* Accumulate totals */
 		total_remote_calls += mi.machine().remote_connection_count();
+		total_banked += mi.machine().banked_memory_bytes();
 		reqid_requests.push_back(mi.stats().invocations);
 		calculate_totals(totals, mi.stats());
 	}
+	vms_lock.unlock();
 
 	auto& requests = obj["request"];
 	requests["machines"] = std::move(machines);
@@ -150,17 +173,21 @@ void TenantInstance::gather_stats(nlohmann::json& j)
 		{"timeouts",    totals.timeouts},
 		{"reservation_time",   totals.reservation_time},
 		{"reset_time",         totals.vm_reset_time},
+		{"reset_time_avg",     totals.resets > 0 ? totals.vm_reset_time / totals.resets : 0.0},
 		{"request_cpu_time",   totals.request_cpu_time},
 		{"exception_cpu_time", totals.error_cpu_time},
 		{"input_bytes", totals.input_bytes},
 		{"output_bytes",totals.output_bytes},
+		{"vm_bank_current", total_banked},
 		{"status_2xx",  totals.status_2xx},
 		{"status_3xx",  totals.status_3xx},
 		{"status_4xx",  totals.status_4xx},
 		{"status_5xx",  totals.status_5xx},
 		{"distribution_requests", reqid_requests},
 		{"vm_remote_calls", total_remote_calls},
-		{"num_machines", num_machines}
+		/* Configured VMs, and the VMs that are forked right now. */
+		{"num_machines", num_machines},
+		{"active_machines", active_machines}
 	}});
 
 	obj["program"] = {
@@ -180,7 +207,23 @@ void TenantInstance::gather_stats(nlohmann::json& j)
 		{"live_update_transfer_bytes", prog->stats.live_update_transfer_bytes},
 		{"reservation_time",     totals.reservation_time},
 		{"reservation_timeouts", prog->stats.reservation_timeouts},
+		{"borrow_timeouts",      prog->stats.borrow_timeouts},
+		{"admission_rejects",    prog->stats.admission_rejects},
+		{"numa_steals",          prog->stats.numa_steals},
+		{"vms_forked",           prog->stats.vms_forked},
+		{"vms_released",         prog->stats.vms_released},
+		{"working_memory", {
+			{"adaptive", this->config.group.adaptive_working_memory},
+			{"estimate", prog->m_working_memory.estimate()},
+			{"retained", prog->m_working_memory.retained()},
+			{"probes",   prog->m_working_memory.probes()}
+		}},
 	};
 
+	/* Response cache */
+	if (this->response_cache != nullptr) {
+		this->response_cache->gather_stats(obj["cache"]);
+	}
+
 }
 } // kvm
@@ -1,4 +1,5 @@
 #include "machine_instance.hpp"
+#include "memory_governor.hpp"
 #include "program_instance.hpp"
 #include "scoped_duration.hpp"
 #include "settings.hpp"
@@ -236,11 +237,13 @@ double MachineInstance::initialize()
 			// Load the programs state as well
 			program().load_state(machine().get_snapshot_state_user_area());
 			this->m_inputs_allocation = program().state.inputs_allocation;
+			this->m_request_batch_max = program().state.request_batch_max;
 			if (tenant().config.group.verbose_pagetable) {
 				machine().print_pagetables();
 			}
 			// Set as waiting for requests
 			this->wait_for_requests();
+			this->account_memory();
 			return 0.0f;
 		}
 
@@ -375,6 +378,7 @@ double MachineInstance::initialize()
 			this->m_store_state_on_reset = true;
 		}
 
+		this->account_memory();
 		return warmup_time;
 	}
 	catch (const tinykvm::MachineException& me)
@@ -441,6 +445,7 @@ MachineInstance::MachineInstance(
 	  m_is_storage(source.is_storage()),
 	  m_is_ephemeral(source.is_ephemeral()),
 	  m_waiting_for_requests(true), // If we got this far, we are waiting...
+	  m_request_batch_max(source.m_request_batch_max),
 	  m_binary_type(source.binary_type()),
 	  m_sighandler{source.m_sighandler},
 	  m_inputs_allocation{source.m_inputs_allocation},
@@ -535,6 +540,8 @@ void MachineInstance::reset_to(MachineInstance& source)
 	/* We only reset ephemeral VMs. */
 	if (reset_needed) {
 		ScopedDuration cputime(this->stats().vm_reset_time);
+		/* The memory used by the request, before it is reset away. */
+		this->account_memory();
 		auto& main_vm = *program().main_vm;
 		if (main_vm.m_store_state_on_reset) {
 			main_vm.m_store_state_on_reset = false;
@@ -587,6 +594,7 @@ void MachineInstance::reset_to(MachineInstance& source)
 			main_vm.machine().save_snapshot_state_now(populate_pages);
 			// Save program state as well
 			program().state.inputs_allocation = this->get_inputs_allocation();
+			program().state.request_batch_max = this->request_batch_max();
 			program().save_state(main_vm.machine().get_snapshot_state_user_area());
 			printf("Saved state on reset for program '%s' (%zu accessed pages, mode '%s')\n",
 				tenant().config.name.c_str(), populate_pages.size(),
@@ -599,14 +607,25 @@ void MachineInstance::reset_to(MachineInstance& source)
 			}
 		}
 
+		// Under memory pressure, no working memory is kept
+		const bool pressure = MemoryGovernor::get().under_pressure();
+		uint64_t keep_work_mem = pressure ? 0 : tenant().config.limit_req_memory();
+		// When m_reset_needed is true, we want to do a full reset
+		bool keep_all_work_mem = !pressure && !this->m_reset_needed && tenant().config.group.ephemeral_keep_working_memory;
+		if (tenant().config.group.adaptive_working_memory && !pressure) {
+			keep_work_mem = program().m_working_memory.retain(
+				machine().banked_memory_bytes(), this->m_work_mem_kept);
+			keep_all_work_mem = false;
+		}
 		const bool full_reset = machine().reset_to(source.machine(), {
 			.max_mem = tenant().config.max_main_memory(),
 			.max_cow_mem = tenant().config.max_req_memory(),
-			.reset_free_work_mem = tenant().config.limit_req_memory(),
+			.reset_free_work_mem = keep_work_mem,
 			.reset_copy_all_registers = true,
-			// When m_reset_needed is true, we want to do a full reset
-			.reset_keep_all_work_memory = !this->m_reset_needed && tenant().config.group.ephemeral_keep_working_memory,
+			.reset_keep_all_work_memory = keep_all_work_mem,
 		});
+		this->account_memory();
+		this->m_trimmed = pressure;
 		stats().resets ++;
 		if (full_reset) {
 			stats().full_resets ++;
@@ -614,6 +633,7 @@ void MachineInstance::reset_to(MachineInstance& source)
 
 		this->m_waiting_for_requests = source.m_waiting_for_requests;
 		this->m_inputs_allocation = source.m_inputs_allocation;
+		this->m_request_batch_max = source.m_request_batch_max;
 		/* The POST memory area is gone. */
 		this->m_post_size = 0;
 
@@ -639,6 +659,33 @@ void MachineInstance::reset_to(MachineInstance& source)
 MachineInstance::~MachineInstance()
 {
 	this->tail_reset();
+	MemoryGovernor::get().add(-int64_t(m_banked_accounted));
+}
+
+void MachineInstance::account_memory()
+{
+	const uint64_t banked = machine().banked_memory_bytes();
+	MemoryGovernor::get().add(int64_t(banked) - int64_t(m_banked_accounted));
+	m_banked_accounted = banked;
+}
+bool MachineInstance::trim_memory()
+{
+	/* VMs that keep their state, and the first reset, which stores
+	   the cold start state, are left alone. */
+	auto& main_vm = *program().main_vm;
+	if (m_trimmed || !this->is_reset_needed() || main_vm.m_store_state_on_reset)
+		return false;
+	machine().reset_to(main_vm.machine(), {
+		.max_mem = tenant().config.max_main_memory(),
+		.max_cow_mem = tenant().config.max_req_memory(),
+		.reset_free_work_mem = 0,
+		.reset_copy_all_registers = true,
+		.reset_keep_all_work_memory = false,
+	});
+	this->m_work_mem_kept = 0;
+	this->m_trimmed = true;
+	this->account_memory();
+	return true;
 }
 
 void MachineInstance::wait_for_requests_paused()
@@ -646,6 +693,11 @@ void MachineInstance::wait_for_requests_paused()
 	this->m_waiting_for_requests = true;
 	//printf("*** Waiting for requests in paused state\n");
 }
+void MachineInstance::wait_for_request_batch_paused(uint16_t max)
+{
+	this->m_waiting_for_requests = true;
+	this->m_request_batch_max = max;
+}
 
 void MachineInstance::copy_to(uint64_t addr, const void* src, size_t len, bool zeroes)
 {
@@ -10,6 +10,7 @@
 namespace kvm {
 class TenantInstance;
 class ProgramInstance;
+struct HttpFields;
 
 /**
  * MachineInstance is a collection of state that is per VM,
@@ -69,13 +70,28 @@ public:
 	/* For now, pausing does nothing. */
 	void wait_for_requests_paused();
 	bool is_waiting_for_requests() const noexcept { return m_waiting_for_requests; }
+	/* Programs that handle several requests per VM entry. */
+	void wait_for_request_batch_paused(uint16_t max);
+	uint16_t request_batch_max() const noexcept { return m_request_batch_max; }
 	/* With this we can enforce that certain syscalls have been invoked before
 	   we even check the validity of responses. This makes sure that crashes does
 	   not accidentally produce valid responses, which can cause confusion. */
-	void begin_call() { m_response_called = 0; }
+	void begin_call() { m_response_called = 0; m_cacheable = {}; m_trimmed = false; }
 	void finish_call(uint8_t n) { m_response_called = n; }
 	bool response_called(uint8_t n) const noexcept { return m_response_called == n; }
 	void reset_needed_now() { m_reset_needed = true; }
+	/* The programs caching decision for the current response. */
+	struct Cacheable {
+		bool     cached = false;
+		uint32_t ttl_ms = 0;
+		uint32_t grace_ms = 0;
+		uint32_t keep_ms = 0;
+	};
+	void set_cacheable(const Cacheable& c) noexcept { m_cacheable = c; }
+	const Cacheable& cacheable() const noexcept { return m_cacheable; }
+	/* The HTTP request being handled, if any. */
+	void set_http_fields(HttpFields* http) noexcept { m_http_fields = http; }
+	HttpFields* http_fields() const noexcept { return m_http_fields; }
 	bool is_reset_needed() const;
 
 	void init_sha256();
@@ -102,6 +118,13 @@ public:
 	~MachineInstance();
 	void tail_reset();
 	void reset_to(MachineInstance&);
+	/* Memory pressure: Reset a free VM, keeping none of its working memory.
+	   Returns false if there was nothing to trim, as the VM has not been
+	   used since it was last trimmed. */
+	bool trim_memory();
+	bool is_trimmed() const noexcept { return m_trimmed; }
+	/* Tell the memory governor how the banked memory changed. */
+	void account_memory();
 	void print_profiling() const;
 
 private:
@@ -123,13 +146,19 @@ private:
 	uint8_t     m_response_called = 0;
 	bool        m_reset_needed = false;
 	bool        m_store_state_on_reset = false;
+	uint16_t    m_request_batch_max = 0;
 	mutable bool m_last_newline = true;
 	BinaryType m_binary_type = BinaryType::Static;
 	gaddr_t     m_sighandler = 0x0;
+	Cacheable   m_cacheable;
+	HttpFields* m_http_fields = nullptr;
 
 	gaddr_t     m_post_data = 0x0;
 	size_t      m_post_size = 0;
 	gaddr_t     m_inputs_allocation = 0x0;
+	uint64_t    m_banked_accounted = 0;
+	uint64_t    m_work_mem_kept = 0; /* At the last reset, with adaptive working memory */
+	bool        m_trimmed = false; /* No working memory kept since the last request */
 
 	MachineStats m_stats;
 
@@ -0,0 +1,145 @@
+#include "memory_governor.hpp"
+
+#include "program_instance.hpp"
+#include "scoped_duration.hpp"
+#include "settings.hpp"
+#include "tenant_instance.hpp"
+#include "../settings.hpp"
+#include <algorithm>
+#include <cstdio>
+
+namespace kvm {
+
+MemoryGovernor& MemoryGovernor::get()
+{
+	/* Leaked on purpose: VMs report to the governor when they are
+	   destroyed, which may happen after function-local statics. */
+	static MemoryGovernor* governor = new MemoryGovernor(uint64_t(g_settings.vm_memory_budget) << 20);
+	return *governor;
+}
+
+MemoryGovernor::MemoryGovernor(uint64_t budget)
+	: m_budget(budget)
+{
+	if (m_budget != 0) {
+		m_thread = std::thread(&MemoryGovernor::main_loop, this);
+	}
+}
+MemoryGovernor::~MemoryGovernor()
+{
+	if (m_thread.joinable()) {
+		{
+			std::scoped_lock lock(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+}
+
+uint64_t MemoryGovernor::banked() const noexcept
+{
+	return std::max<int64_t>(0, m_banked.load(std::memory_order_relaxed));
+}
+
+void MemoryGovernor::add_program(ProgramInstance* prog)
+{
+	std::scoped_lock lock(m_programs_mtx);
+	m_programs.push_back(prog);
+}
+void MemoryGovernor::remove_program(ProgramInstance* prog)
+{
+	std::scoped_lock lock(m_programs_mtx);
+	auto it = std::find(m_programs.begin(), m_programs.end(), prog);
+	if (it != m_programs.end())
+		m_programs.erase(it);
+}
+
+void MemoryGovernor::main_loop()
+{
+	const uint64_t high = m_budget * MEMORY_HIGH_WATERMARK;
+	const uint64_t low  = m_budget * MEMORY_LOW_WATERMARK;
+	std::unique_lock<std::mutex> lock(m_mtx);
+	while (!m_cv.wait_for(lock, std::chrono::milliseconds(MEMORY_GOVERNOR_INTERVAL_MS),
+		[this] { return m_stop; }))
+	{
+		const uint64_t banked = this->banked();
+		if (!m_pressure && banked > high) {
+			m_pressure = true;
+			m_pressure_events ++;
+			fprintf(stderr, "Memory pressure: %lu of %lu MiB banked\n",
+				banked >> 20, m_budget >> 20);
+		} else if (m_pressure && banked < low) {
+			m_pressure = false;
+		}
+		if (m_pressure) {
+			lock.unlock();
+			this->reclaim();
+			lock.lock();
+		}
+	}
+}
+
+void MemoryGovernor::reclaim()
+{
+	const uint64_t low = m_budget * MEMORY_LOW_WATERMARK;
+	/* Trimming waits for VM workers, and a worker may drop the last
+	   reference to a program, which then removes itself from the
+	   registry. So the registry lock is only held while taking
+	   references to the current program of each tenant. Programs
+	   that have already been replaced are going away anyway. */
+	std::vector<std::pair<uint64_t, std::shared_ptr<ProgramInstance>>> programs;
+	{
+		std::scoped_lock lock(m_programs_mtx);
+		programs.reserve(m_programs.size());
+		for (auto* prog : m_programs) {
+			auto& tenant = prog->main_vm->tenant();
+			auto ref = std::atomic_load(&tenant.program);
+			if (ref.get() == prog)
+				programs.emplace_back(tenant.last_request.load(), std::move(ref));
+		}
+	}
+	/* Least recently used tenants first. */
+	std::sort(programs.begin(), programs.end(),
+		[] (const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (auto& it : programs) {
+		if (this->banked() < low)
+			return;
+		m_trimmed_vms += it.second->trim_free_vms();
+	}
+	/* Hibernate the least recently used tenant that allows it. Its
+	   memory is given back once requests stop referencing it, so
+	   only one tenant is hibernated at a time: Until the previous
+	   one is gone, its memory is still banked. */
+	if (!m_hibernating.expired())
+		return;
+	const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	const uint64_t min_idle = MEMORY_HIBERNATE_MIN_IDLE_MS * 1'000'000ull;
+	for (auto& it : programs) {
+		if (now < it.first + min_idle)
+			return; /* Sorted, so the rest are more recent */
+		if (TenantInstance* tenant = it.second->m_hibernatable) {
+			if (tenant->hibernate(it.second.get(), "memory pressure")) {
+				m_hibernating = it.second;
+				m_hibernations ++;
+			}
+			return;
+		}
+	}
+}
+
+void MemoryGovernor::gather_stats(nlohmann::json& j) const
+{
+	j = {
+		{"budget",   m_budget},
+		{"banked",   this->banked()},
+		{"headroom", m_budget != 0 ? this->headroom() : 0},
+		{"pressure", this->under_pressure()},
+		{"pressure_events", m_pressure_events.load(std::memory_order_relaxed)},
+		{"trimmed_vms",     m_trimmed_vms.load(std::memory_order_relaxed)},
+		{"hibernations",    m_hibernations.load(std::memory_order_relaxed)}
+	};
+}
+
+} // kvm
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace kvm {
+class ProgramInstance;
+
+/**
+ * MemoryGovernor keeps the banked memory of all VMs in the process
+ * within the memory budget (--memory-budget). Each VM reports how its
+ * banked memory changed when it is created, reset and destroyed.
+ *
+ * Above the high watermark the process is under pressure, and memory is
+ * reclaimed until it is below the low watermark again, in this order:
+ * 1. VMs that are reset keep none of their working memory.
+ * 2. Free VMs of the least recently used tenants give back their
+ *    working memory. Request threads put back their sticky VMs that
+ *    were not used since their last sweep, so that those are trimmed
+ *    too.
+ * 3. The least recently used tenants are hibernated, one at a time,
+ *    when they have been idle for a while.
+ *
+ * Without a budget, memory is only counted.
+**/
+class MemoryGovernor {
+public:
+	/* The governor of the process, created on first use and never destroyed. */
+	static MemoryGovernor& get();
+
+	/* The banked memory of a VM changed by delta bytes. */
+	void add(int64_t delta) noexcept { m_banked.fetch_add(delta, std::memory_order_relaxed); }
+	uint64_t banked() const noexcept;
+	uint64_t budget() const noexcept { return m_budget; }
+	/* Bytes left before the budget, negative when above it. */
+	int64_t headroom() const noexcept { return int64_t(m_budget) - int64_t(banked()); }
+	/* Racy: Reclaiming memory, between the high and low watermarks. */
+	bool under_pressure() const noexcept { return m_pressure.load(std::memory_order_relaxed); }
+
+	/* Programs that memory can be reclaimed from. A program must
+	   remove itself before anything else when it is destroyed. The
+	   governor never waits for a VM worker while holding the list. */
+	void add_program(ProgramInstance*);
+	void remove_program(ProgramInstance*);
+
+	void gather_stats(nlohmann::json& j) const;
+
+	MemoryGovernor(uint64_t budget);
+	~MemoryGovernor();
+
+private:
+	void main_loop();
+	void reclaim();
+
+	const uint64_t m_budget;
+	std::atomic<int64_t> m_banked {0};
+	std::atomic<bool> m_pressure {false};
+
+	std::mutex m_programs_mtx;
+	std::vector<ProgramInstance*> m_programs;
+	/* The last program hibernated, alive until requests let go of it */
+	std::weak_ptr<ProgramInstance> m_hibernating;
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+	std::thread m_thread;
+
+	std::atomic<uint64_t> m_pressure_events {0};
+	std::atomic<uint64_t> m_trimmed_vms {0};
+	std::atomic<uint64_t> m_hibernations {0};
+};
+
+} // kvm
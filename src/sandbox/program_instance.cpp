@@ -1,17 +1,19 @@
 #include "program_instance.hpp"
 
 #include "curl_fetch.hpp"
+#include "memory_governor.hpp"
 #include "settings.hpp"
+#include "../settings.hpp"
 #include "tenant_instance.hpp"
 #include "scoped_duration.hpp"
 #include "timing.hpp"
+#include <algorithm>
 #include <cstring>
 #include <tinykvm/rsp_client.hpp>
 #include <sched.h>
 #include <unistd.h>
 extern "C" {
 extern int usleep(uint32_t usec);
-extern int numa_max_node();
 }
 namespace kvm {
 extern std::vector<uint8_t> file_loader(const std::string&);
@@ -20,15 +22,34 @@ extern void extract_programs_to(kvm::ProgramInstance&, const char *, size_t);
 static constexpr bool VERBOSE_STORAGE_TASK = false;
 static constexpr bool VERBOSE_PROGRAM_STARTUP = false;
 
-VMPoolItem::VMPoolItem(unsigned reqid, const MachineInstance& main_vm,
-	TenantInstance* ten, ProgramInstance* prog)
+static VMWorkerPool::Worker& assign_worker(
+	std::unique_ptr<VMWorkerPool::Worker>& own, int node, bool dedicated)
+{
+	auto& shared = VMWorkerPool::get().assign(node);
+	if (!dedicated)
+		return shared;
+	own = std::make_unique<VMWorkerPool::Worker>(shared.cpu(), shared.node(), REQUEST_VM_NICE);
+	return *own;
+}
+
+VMPoolItem::VMPoolItem(unsigned id, int node, bool dedicated)
 	: mi {nullptr},
-	  tp {REQUEST_VM_NICE, false}
+	  reqid {id},
+	  worker {assign_worker(own_worker, node, dedicated)}
+{
+	if (g_settings.reservations) {
+		/* Reserved requests may block, so they cannot share a worker,
+		   but they still run on the CPU of the VM. */
+		this->handoff = std::make_unique<VMHandoff>(REQUEST_VM_NICE, worker.cpu());
+	}
+}
+void VMPoolItem::fork(const MachineInstance& main_vm,
+	const TenantInstance* ten, ProgramInstance* prog)
 {
-	// Spawn forked VM on dedicated thread, blocking.
+	// Spawn forked VM on its worker. Wait for task_future.
 	// XXX: We are deliberately not catching exceptions here.
-	this->task_future = tp.enqueue(
-	[=, &main_vm] () -> long {
+	this->task_future = worker.enqueue(
+	[=, this, &main_vm] () -> long {
 		this->mi = std::make_unique<MachineInstance> (
 			reqid, main_vm, ten, prog);
 		return 0;
@@ -47,13 +68,18 @@ void VMPoolItem::reset()
 	// XXX: Is this racy? We want to enq the slot with the ref.
 	// We are the sole owner of the slot, so no need for atomics here.
 	auto ref = std::move(this->prog_ref);
+	// The time this VM was taken, for admission control
+	const uint64_t service = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - this->reserved_at;
+	const uint64_t ewma = ref->m_service_ns.load(std::memory_order_relaxed);
+	ref->m_service_ns.store(ewma == 0 ? service : ewma - ewma / 8 + service / 8, std::memory_order_relaxed);
 	// Signal waiters that slot is ready again
 	// If there any waiters, they keep the program referenced (atomically)
-	ref->m_vmqueue[ProgramInstance::numa_node()].enqueue(this);
+	ref->m_vms_in_use.fetch_sub(1, std::memory_order_relaxed);
+	ref->m_vmqueue[this->node()].enqueue(this);
 }
 void VMPoolItem::deferred_reset()
 {
-	this->task_future = tp.enqueue(
+	this->task_future = worker.enqueue(
 	[this] () -> long {
 		auto& mi = *this->mi;
 
@@ -65,6 +91,28 @@ void VMPoolItem::deferred_reset()
 	});
 }
 
+void VMPoolItem::deferred_free()
+{
+	/* The future is not kept, as the slot can be reserved again
+	   by another thread as soon as it is back in the queue. */
+	worker.enqueue(
+	[this] () -> long {
+		try {
+			this->reset();
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s: Exception when resetting VM: %s\n",
+				mi->name().c_str(), e.what());
+		}
+		return 0;
+	});
+}
+void VMPoolItem::release()
+{
+	auto ref = std::move(this->prog_ref);
+	ref->m_vms_in_use.fetch_sub(1, std::memory_order_relaxed);
+	ref->m_vmqueue[this->node()].enqueue(this);
+}
+
 Storage::Storage(BinaryStorage storage_elf)
 	: storage_binary{std::move(storage_elf)}
 {
@@ -228,6 +276,9 @@ void ProgramInstance::begin_initialization(TenantInstance *ten, bool debug)
 		const size_t max_vms = ten->config.group.max_concurrency;
 		if (max_vms < 1)
 			throw std::runtime_error("Concurrency must be at least 1");
+		m_request_vm_memory = ten->config.max_req_memory();
+		m_working_memory.configure(ten->config.group.min_limit_req_mem,
+			std::min(ten->config.limit_req_memory(), ten->config.max_req_memory()));
 
 		TIMING_LOCATION(t0);
 
@@ -302,20 +353,33 @@ void ProgramInstance::begin_initialization(TenantInstance *ten, bool debug)
 
 		TIMING_LOCATION(t1);
 
-		// Instantiate forked VMs on dedicated threads, in
+		// Instantiate forked VMs on pinned workers, in
 		// order to prevent KVM migrations. First we create
 		// one forked VM and immediately start accepting
 		// requests, while we continously add more concurrency
-		// to the queue.
+		// to the queue. VMs are spread evenly over the NUMA
+		// nodes, and forked on a worker of their node.
+		// Elastic pools only fork min_concurrency VMs now.
+		const auto& nodes = VMWorkerPool::get().nodes();
+		const size_t min_vms = ten->config.group.min_concurrency;
+		const bool dedicated = ten->config.group.dedicated_vm_threads;
+		for (size_t i = 0; i < max_vms; i++) {
+			m_vms.emplace_back(i, nodes[i % nodes.size()], dedicated);
+		}
+		m_wait_queue.set_weights(ten->config.group.priority_weights);
+		std::scoped_lock vms_lock(m_vms_mtx);
 
 		// Instantiate first forked VM
 		// XXX: This can fail and throw an exception,
 		// think *long and hard* about the consequences!
-		m_vms.emplace_back(0, *main_vm, ten, this);
+		m_vms.front().fork(*main_vm, ten, this);
 
 		// Make sure the first VM is up and running before queueing
 		m_vms.front().task_future.get();
-		m_vmqueue[0].enqueue(&m_vms.front());
+		m_vmqueue[m_vms.front().node()].enqueue(&m_vms.front());
+		m_active_vms = 1;
+		s_request_vm_memory += m_request_vm_memory;
+		stats.vms_forked = 1;
 
 		// Start accepting incoming requests on thread pool.
 		this->unlock_and_initialized(true);
@@ -323,25 +387,59 @@ void ProgramInstance::begin_initialization(TenantInstance *ten, bool debug)
 		TIMING_LOCATION(t2);
 
 		// Instantiate remaining concurrency
-		for (size_t i = 1; i < max_vms; i++) {
-			m_vms.emplace_back(i, *main_vm, ten, this);
+		for (size_t i = 1; i < min_vms; i++) {
+			m_vms[i].fork(*main_vm, ten, this);
 		}
 
-		const unsigned n_nodes = std::min(size_t(1) + numa_max_node(), m_vmqueue.size());
-		size_t initialized = 1;
 		// Wait for all the VMs to start running
 		for (size_t i = 1; i < m_vms.size(); i++) {
+			auto& vm = m_vms[i];
+			if (i >= min_vms) {
+				m_parked_vms.push_back(&vm);
+				continue;
+			}
 			try {
-				auto& vm = m_vms[i];
 				vm.task_future.get();
-				m_vmqueue[i % n_nodes].enqueue(&vm);
-				initialized ++;
+				m_vmqueue[vm.node()].enqueue(&vm);
+				m_active_vms ++;
+				s_request_vm_memory += m_request_vm_memory;
+				stats.vms_forked ++;
 			} catch (const std::exception& e) {
 				fprintf(stderr,
 					"%s: Failed to create all request machines, init=%zu",
-					ten->config.name.c_str(), initialized);
+					ten->config.name.c_str(), m_active_vms.load());
 			}
 		}
+		/* Parked VMs are forked in reverse, from the lowest request ID. */
+		std::reverse(m_parked_vms.begin(), m_parked_vms.end());
+		if (ten->config.group.is_elastic()) {
+			m_timer_system.add(
+				std::chrono::milliseconds(AUTOSCALE_INTERVAL_MS),
+				[this] (auto) { this->autoscale(); },
+				std::chrono::milliseconds(AUTOSCALE_INTERVAL_MS));
+		}
+		/* Storage VMs have state that would be lost, and epoll
+		   systems serve clients without requests. */
+		if (!debug && !this->has_storage() && m_epoll_systems.empty())
+			m_hibernatable = ten;
+		/* The quiet period starts when the program is ready. */
+		ten->last_request.store(ScopedDuration<CLOCK_MONOTONIC>::nanos_now());
+		if (m_hibernatable && ten->config.group.hibernate_after > 0.0f)
+		{
+			m_timer_system.add(
+				std::chrono::milliseconds(HIBERNATE_CHECK_INTERVAL_MS),
+				[this, ten] (auto) {
+					/* VMs still held by requests keep this program alive. */
+					const uint64_t quiet = ten->config.group.hibernate_after * 1e9;
+					if (ScopedDuration<CLOCK_MONOTONIC>::nanos_now()
+						> ten->last_request.load(std::memory_order_relaxed) + quiet)
+						ten->hibernate(this, "idle");
+				},
+				std::chrono::milliseconds(HIBERNATE_CHECK_INTERVAL_MS));
+		}
+		const size_t initialized = m_active_vms;
+		if (!debug)
+			MemoryGovernor::get().add_program(this);
 
 		(void) t1;
 		std::string storage_info = "no";
@@ -385,7 +483,9 @@ void ProgramInstance::begin_initialization(TenantInstance *ten, bool debug)
 }
 ProgramInstance::~ProgramInstance()
 {
-	/* Finish starting any request VMs and ignore exceptions. */
+	MemoryGovernor::get().remove_program(this);
+	/* Finish starting (and releasing) any request VMs and ignore
+	   exceptions. Only then is the number of forked VMs final. */
 	for (size_t i = 1; i < m_vms.size(); i++) {
 		auto& vm = m_vms[i];
 		if (vm.task_future.valid()) {
@@ -394,6 +494,10 @@ ProgramInstance::~ProgramInstance()
 			} catch (...) {}
 		}
 	}
+	{
+		std::scoped_lock lock(m_vms_mtx);
+		s_request_vm_memory -= m_active_vms * m_request_vm_memory;
+	}
 
 	for (auto& sys : m_epoll_systems) {
 		sys.stop();
@@ -441,21 +545,60 @@ void ProgramInstance::set_entry_at(const int idx, gaddr_t addr)
 	state.entry_address.at(idx) = addr;
 }
 
-Reservation ProgramInstance::reserve_vm(
-	TenantInstance* ten, std::shared_ptr<ProgramInstance> prog)
+VMPoolItem* ProgramInstance::take_vm(VMAdmission& adm, float max_wait, uint64_t& timeouts)
 {
-	const auto tmo = std::chrono::seconds(ten->config.group.max_queue_time);
 	VMPoolItem* slot = nullptr;
-	auto t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
-	{
-		// Fixate on current NUMA node, for performance reasons.
-		const int node = numa_node();
-		if (UNLIKELY(!m_vmqueue[node].wait_dequeue_timed(slot, tmo))) {
-			prog->stats.reservation_timeouts ++; /* Racy, but uncontended */
-			throw std::runtime_error("Queue timeout");
-		}
-		assert(slot);
+	const int node = numa_node();
+	// Prefer the current NUMA node, for performance reasons. When
+	// nobody is waiting, there is nobody to be fair to.
+	if (m_wait_queue.waiting() == 0 && dequeue_vm(node, slot, std::chrono::microseconds(0)))
+		return slot;
+
+	float budget = max_wait;
+	if (adm.budget >= 0.0f)
+		budget = std::min(budget, adm.budget);
+	/* Turn the request away now, if it is expected to wait longer than
+	   it can. The expected wait is how many requests are served before
+	   it, times how long each of them takes a VM. */
+	const uint8_t priority = std::min<uint8_t>(adm.priority, VMAdmission::NUM_PRIORITIES - 1);
+	const double service = m_service_ns.load(std::memory_order_relaxed) * 1e-9;
+	const double expected = (m_wait_queue.ahead_of(priority) + 1) * service
+		/ std::max<size_t>(1, m_active_vms.load(std::memory_order_relaxed));
+	if (expected > budget) {
+		adm.retry_after = expected;
+		stats.admission_rejects ++; /* Racy */
+		return nullptr;
 	}
+
+	/* The request has to wait for a VM, which counts as one shortage,
+	   however many times it then tries to take one. */
+	this->vm_shortage();
+
+	using clock = VMWaitQueue::clock;
+	const auto deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+		std::chrono::duration<float>(budget));
+	VMWaitQueue::Waiter waiter(priority);
+	bool dequeued = false;
+	if (m_wait_queue.wait_turn(waiter, deadline)) {
+		const auto remaining = std::max(clock::duration::zero(), deadline - clock::now());
+		dequeued = dequeue_vm(node, slot,
+			std::chrono::duration_cast<std::chrono::microseconds>(remaining));
+		m_wait_queue.done(waiter);
+	}
+	if (UNLIKELY(!dequeued)) {
+		adm.retry_after = std::max<double>(budget, expected);
+		timeouts ++; /* Racy */
+		return nullptr;
+	}
+	return slot;
+}
+Reservation ProgramInstance::reserve_vm(
+	TenantInstance* ten, std::shared_ptr<ProgramInstance> prog, VMAdmission& adm)
+{
+	auto t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	VMPoolItem* slot = take_vm(adm, ten->config.group.max_queue_time, stats.reservation_timeouts);
+	if (UNLIKELY(slot == nullptr))
+		return {nullptr, vm_free_function};
 	/* Time spent reserving this VM. */
 	slot->mi->stats().reservation_time += (ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0) * 1e-9;
 
@@ -466,6 +609,198 @@ Reservation ProgramInstance::reserve_vm(
 	/* What happens when the transaction is done */
 	return {slot, vm_free_function};
 }
+VMPoolItem* ProgramInstance::try_reserve_vm(std::shared_ptr<ProgramInstance> prog)
+{
+	VMPoolItem* slot = nullptr;
+	if (m_wait_queue.waiting() > 0 || !dequeue_vm(numa_node(), slot, std::chrono::microseconds(0)))
+		return nullptr;
+	assert(slot);
+	slot->prog_ref = std::move(prog);
+	return slot;
+}
+Reservation ProgramInstance::borrow_vm(
+	TenantInstance* ten, std::shared_ptr<ProgramInstance> prog, VMAdmission& adm)
+{
+	auto t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	VMPoolItem* slot = take_vm(adm, ten->config.group.max_borrow_time, stats.borrow_timeouts);
+	if (UNLIKELY(slot == nullptr))
+		return {nullptr, vm_free_function};
+	slot->mi->stats().reservation_time += (ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0) * 1e-9;
+	slot->prog_ref = std::move(prog);
+	return {slot, vm_free_function};
+}
+void ProgramInstance::vm_shortage()
+{
+	m_vm_shortages.fetch_add(1, std::memory_order_relaxed);
+	/* An elastic pool grows right away, instead of at the next interval. */
+	if (main_vm->tenant().config.group.is_elastic() && !m_grow_pending.exchange(true)) {
+		m_timer_system.add(std::chrono::milliseconds(0),
+			[this] (auto) { m_grow_pending = false; this->autoscale(); });
+	}
+}
+bool ProgramInstance::dequeue_vm(int node, VMPoolItem*& slot, std::chrono::microseconds timeout)
+{
+	if (!m_vmqueue[node].try_dequeue(slot)) {
+		if (!this->wait_for_vm(node, slot, timeout))
+			return false;
+	}
+	slot->reserved_at = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	const int in_use = m_vms_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+	int peak = m_vms_peak_in_use.load(std::memory_order_relaxed);
+	while (in_use > peak && !m_vms_peak_in_use.compare_exchange_weak(peak, in_use, std::memory_order_relaxed));
+	return true;
+}
+bool ProgramInstance::wait_for_vm(int node, VMPoolItem*& slot, std::chrono::microseconds timeout)
+{
+	auto& local = m_vmqueue[node];
+	const auto& nodes = VMWorkerPool::get().nodes();
+	if (nodes.size() == 1)
+		return local.wait_dequeue_timed(slot, timeout);
+
+	using clock = std::chrono::steady_clock;
+	const auto deadline = clock::now() + timeout;
+	const auto local_wait = std::chrono::microseconds(NUMA_LOCAL_WAIT_US);
+	while (true) {
+		const auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - clock::now());
+		if (local.wait_dequeue_timed(slot, std::clamp(remaining, std::chrono::microseconds(0), local_wait)))
+			return true;
+		for (const int other : nodes) {
+			if (other != node && m_vmqueue[other].try_dequeue(slot)) {
+				this->stats.numa_steals ++; /* Racy */
+				return true;
+			}
+		}
+		if (clock::now() >= deadline)
+			return false;
+	}
+}
+bool ProgramInstance::unpark_vm()
+{
+	if (m_parked_vms.empty())
+		return false;
+	/* Stay within the global budget for request VM memory. */
+	const uint64_t budget = uint64_t(g_settings.vm_memory_budget) << 20;
+	if (budget != 0 && s_request_vm_memory.load() + m_request_vm_memory > budget)
+		return false;
+	if (MemoryGovernor::get().under_pressure())
+		return false;
+
+	/* The VM is forked on its worker, and put in the queue when it is
+	   ready. Nothing waits for the fork, as m_vms_mtx is held here. The
+	   memory is counted right away, so that the budget is kept. */
+	auto* vm = m_parked_vms.back();
+	m_parked_vms.pop_back();
+	s_request_vm_memory += m_request_vm_memory;
+	m_forks_pending ++;
+	vm->task_future = vm->worker.enqueue(
+	[this, vm] () -> long {
+		std::unique_ptr<MachineInstance> mi;
+		try {
+			mi = std::make_unique<MachineInstance> (
+				vm->reqid, *main_vm, &main_vm->tenant(), this);
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s: Failed to fork request VM: %s\n",
+				main_vm->name().c_str(), e.what());
+		}
+		std::scoped_lock lock(m_vms_mtx);
+		if (mi != nullptr) {
+			vm->mi = std::move(mi);
+			m_active_vms ++;
+			stats.vms_forked ++;
+			m_vmqueue[vm->node()].enqueue(vm);
+		} else {
+			s_request_vm_memory -= m_request_vm_memory;
+			m_parked_vms.push_back(vm);
+		}
+		m_forks_pending --;
+		return 0;
+	});
+	return true;
+}
+bool ProgramInstance::park_vm()
+{
+	VMPoolItem* vm = nullptr;
+	for (const int node : VMWorkerPool::get().nodes()) {
+		if (m_vmqueue[node].try_dequeue(vm))
+			break;
+	}
+	if (vm == nullptr)
+		return false;
+	m_active_vms --;
+	s_request_vm_memory -= m_request_vm_memory;
+	stats.vms_released ++;
+	/* The VM is free, so nothing else is queued on its worker for it.
+	   It is destroyed there, and only then can it be forked again. */
+	vm->task_future = vm->worker.enqueue(
+	[this, vm] () -> long {
+		std::unique_ptr<MachineInstance> mi;
+		{
+			std::scoped_lock lock(m_vms_mtx);
+			mi = std::move(vm->mi);
+		}
+		mi = nullptr;
+		std::scoped_lock lock(m_vms_mtx);
+		m_parked_vms.push_back(vm);
+		return 0;
+	});
+	return true;
+}
+void ProgramInstance::autoscale()
+{
+	const auto& group = main_vm->tenant().config.group;
+	const size_t shortages = m_vm_shortages.exchange(0);
+	const size_t peak = m_vms_peak_in_use.exchange(m_vms_in_use.load());
+
+	std::scoped_lock lock(m_vms_mtx);
+	if (shortages > 0) {
+		/* Grow by the requests that had to wait for a VM, at most doubling,
+		   less the VMs that are still being forked. */
+		m_idle_intervals = 0;
+		size_t grow = std::min(shortages, m_active_vms.load());
+		grow -= std::min(grow, m_forks_pending);
+		while (grow-- > 0 && this->unpark_vm());
+	}
+	else if (peak < m_active_vms && m_active_vms > group.min_concurrency) {
+		/* Release the VMs that were not needed for vm_idle_timeout. */
+		m_idle_intervals ++;
+		if (m_idle_intervals * AUTOSCALE_INTERVAL_MS >= group.vm_idle_timeout * 1000.0f) {
+			m_idle_intervals = 0;
+			size_t shrink = m_active_vms - std::max(peak, group.min_concurrency);
+			while (shrink-- > 0 && this->park_vm());
+		}
+	}
+	else {
+		m_idle_intervals = 0;
+	}
+}
+size_t ProgramInstance::trim_free_vms()
+{
+	/* Each free VM is taken out of its queue while its memory is
+	   given back, and the others can still be reserved meanwhile. */
+	size_t trimmed = 0;
+	for (const int node : VMWorkerPool::get().nodes()) {
+		/* Trimmed VMs go to the back of the queue, so stop after
+		   the VMs that were free when we started. */
+		size_t count = m_vmqueue[node].size_approx();
+		VMPoolItem* vm = nullptr;
+		while (count-- > 0 && m_vmqueue[node].try_dequeue(vm)) {
+			/* VMs that have not been used since they were last trimmed
+			   have nothing to give back. The VM is ours while dequeued. */
+			if (!vm->mi->is_trimmed()) {
+				try {
+					trimmed += vm->worker.enqueue([vm] () -> long {
+						return vm->mi->trim_memory();
+					}).get();
+				} catch (const std::exception& e) {
+					fprintf(stderr, "%s: Exception when trimming VM: %s\n",
+						vm->mi->name().c_str(), e.what());
+				}
+			}
+			m_vmqueue[node].enqueue(vm);
+		}
+	}
+	return trimmed;
+}
 void ProgramInstance::vm_free_function(VMPoolItem* slot)
 {
 	slot->reset();
@@ -760,10 +1095,10 @@ int ProgramInstance::numa_node()
 #ifdef __x86_64__
 	unsigned long a,d,c;
 	__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (c));
-	return c >> 12;
+	return (c >> 12) % MAX_NUMA_NODES;
 #else
 	unsigned cpu_id, node_id;
-	return (getcpu(&cpu_id, &node_id) ? 0 : node_id);
+	return (getcpu(&cpu_id, &node_id) ? 0 : node_id % MAX_NUMA_NODES);
 #endif
 }
 
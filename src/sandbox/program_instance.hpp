@@ -6,7 +6,12 @@
 #include "serialized_state.hpp"
 #include "server/epoll.hpp"
 #include "utils/cpptime.hpp"
+#include "vm_handoff.hpp"
+#include "vm_wait_queue.hpp"
+#include "working_memory.hpp"
+#include "vm_worker_pool.hpp"
 #include <blockingconcurrentqueue.h>
+#include <condition_variable>
 #include <tinykvm/util/threadpool.h>
 #include <tinykvm/util/threadtask.hpp>
 #include <unordered_set>
@@ -25,18 +30,39 @@ struct VirtBuffer {
  * data transfers, and is then put back in a blocking queue.
 **/
 struct VMPoolItem {
-	VMPoolItem(unsigned reqid, const MachineInstance&, TenantInstance*, ProgramInstance*);
-	// VM instance
+	VMPoolItem(unsigned reqid, int node, bool dedicated);
+	// VM instance, or nullptr when not forked (yet)
 	std::unique_ptr<MachineInstance> mi;
+	const unsigned reqid;
 	// Reference that keeps active program alive
 	std::shared_ptr<ProgramInstance> prog_ref = nullptr;
-	// Communicate with this VM using single thread pool
-	tinykvm::ThreadTask<tinykvm::Function<long()>> tp;
+	// A worker of its own, pinned to the same CPU as the shared one
+	std::unique_ptr<VMWorkerPool::Worker> own_worker;
+	// Background work for this VM happens on a shared, pinned worker,
+	// unless the tenant group asks for dedicated VM threads
+	VMWorkerPool::Worker& worker;
+	// The NUMA node of the worker, and the queue this VM belongs in
+	int node() const noexcept { return worker.node(); }
+	// When the VM was taken from the queue, to measure service times
+	uint64_t reserved_at = 0;
 	// We can use this to avoid having to start in a serialized manner
 	std::future<long> task_future;
+	// With reservations, requests are handed to a dedicated thread
+	std::unique_ptr<VMHandoff> handoff;
+
+	/* Run func on the thread of this VM, and wait for the result. */
+	template <typename F>
+	long run(F&& func) {
+		if (handoff != nullptr)
+			return handoff->run(std::forward<F>(func));
+		return worker.enqueue(std::forward<F>(func)).get();
+	}
 
+	void fork(const MachineInstance& main_vm, const TenantInstance*, ProgramInstance*);
 	void reset();
 	void deferred_reset(); // Does not put the slot back in the queue
+	void release(); // Put an already reset slot back in the queue
+	void deferred_free(); // Reset, and then put the slot back in the queue
 };
 
 struct Reservation {
@@ -122,8 +148,16 @@ public:
 	   the initialization. */
 	bool wait_for_main_vm();
 
-	/* Reserve VM from blocking queue. */
-	Reservation reserve_vm(TenantInstance*, std::shared_ptr<ProgramInstance>);
+	/* Reserve VM from blocking queue. Waiting requests are served in
+	   weighted fair order by priority, and requests that are not expected
+	   to get a VM within their budget are turned away early. The slot is
+	   nullptr when no VM could be had, with adm.retry_after set on overload. */
+	Reservation reserve_vm(TenantInstance*, std::shared_ptr<ProgramInstance>, VMAdmission&);
+	/* Borrow a VM for a single request, when there are fewer VMs than
+	   request threads. Borrowers give up after the tenants max_borrow_time. */
+	Reservation borrow_vm(TenantInstance*, std::shared_ptr<ProgramInstance>, VMAdmission&);
+	/* Reserve a VM only if one is free right now, and nobody is waiting. */
+	VMPoolItem* try_reserve_vm(std::shared_ptr<ProgramInstance>);
 	/* Free a reserved VM. This can potentially finish a program. */
 	static void vm_free_function(VMPoolItem*);
 
@@ -148,11 +182,40 @@ public:
 	/* Ready-made *request* VM that can be forked into many small VMs */
 	std::unique_ptr<MachineInstance> main_vm;
 
-	/* Ticket-machine that gives access rights to VMs. */
-	std::array<moodycamel::BlockingConcurrentQueue<VMPoolItem*>, 4> m_vmqueue;
+	/* Ticket-machine that gives access rights to VMs, one per NUMA node.
+	   VMs always go back to the queue of their own node. */
+	std::array<moodycamel::BlockingConcurrentQueue<VMPoolItem*>, MAX_NUMA_NODES> m_vmqueue;
 	/* Simple container for VMs. */
 	std::deque<VMPoolItem> m_vms;
 
+	/* The request VMs of an elastic pool are forked on demand, between
+	   min_concurrency and max_concurrency, and released when they stay
+	   idle. Forks and releases run on the worker of each VM, which
+	   swaps the VM in or out under m_vms_mtx. The parked VMs, and reading
+	   VM statistics, are also under m_vms_mtx. Nothing may wait for a
+	   worker while holding it. */
+	std::mutex m_vms_mtx;
+	std::atomic<size_t> m_active_vms {0}; /* Racy outside m_vms_mtx */
+	std::vector<VMPoolItem*> m_parked_vms;
+	size_t m_forks_pending = 0; /* Under m_vms_mtx */
+	/* Requests that had to wait for a VM, since the last autoscaling. */
+	std::atomic<uint32_t> m_vm_shortages {0};
+	std::atomic<int> m_vms_in_use {0};
+	std::atomic<int> m_vms_peak_in_use {0};
+	std::atomic<bool> m_grow_pending {false};
+	unsigned m_idle_intervals = 0;
+	uint64_t m_request_vm_memory = 0; /* Bytes per forked VM */
+	/* Memory of all forked request VMs, in every program. */
+	static inline std::atomic<uint64_t> s_request_vm_memory {0};
+	void autoscale();
+	/* Memory pressure: Give back the working memory of the VMs that
+	   are free right now. Returns the number of VMs trimmed. */
+	size_t trim_free_vms();
+	/* The tenant, when the program may be hibernated. */
+	TenantInstance* m_hibernatable = nullptr;
+	/* How much working memory request VMs keep after a reset. */
+	WorkingMemoryPolicy m_working_memory;
+
 	std::unique_ptr<Storage> m_storage = nullptr;
 	bool has_storage() const noexcept { return m_storage != nullptr; }
 	inline Storage& storage() {
@@ -184,6 +247,11 @@ public:
 
 	struct Stats {
 		uint64_t reservation_timeouts = 0;
+		uint64_t borrow_timeouts = 0;
+		uint64_t admission_rejects = 0;
+		uint64_t numa_steals = 0;
+		uint64_t vms_forked = 0;
+		uint64_t vms_released = 0;
 		uint64_t live_updates = 0;
 		int64_t  live_update_transfer_bytes = 0;
 	} stats;
@@ -199,9 +267,26 @@ private:
 		this->mtx_future_init.unlock();
 	}
 
+	/* Take a free VM, preferably from the given node. After a short wait
+	   for a local VM, idle VMs are stolen from the other nodes. */
+	bool dequeue_vm(int node, VMPoolItem*& slot, std::chrono::microseconds timeout);
+	bool wait_for_vm(int node, VMPoolItem*& slot, std::chrono::microseconds timeout);
+	/* A request has to wait for a VM. Counted once per request. */
+	void vm_shortage();
+	/* Start forking a parked VM, or releasing an idle one, on its
+	   worker. Under m_vms_mtx, and neither waits for the worker. */
+	bool unpark_vm();
+	bool park_vm();
+
 	std::future<long> m_future;
 	std::future<long> m_async_start_future;
 	std::mutex mtx_future_init;
+	/* Requests waiting for a VM. Only the one whose turn it is waits
+	   on the VM queue. */
+	VMWaitQueue m_wait_queue;
+	/* Moving average of the time a VM is taken, including its reset. */
+	std::atomic<uint64_t> m_service_ns {0};
+	VMPoolItem* take_vm(VMAdmission&, float max_wait, uint64_t& timeouts);
 	int8_t m_initialization_complete = 0;
 	bool m_binary_was_local = false;
 	bool m_binary_was_cached = false;
@@ -0,0 +1,175 @@
+#include "response_cache.hpp"
+
+namespace kvm {
+/* Rough per-object overhead of the LRU list, hash map and response. */
+static constexpr size_t ENTRY_OVERHEAD = 256;
+
+ResponseCache::ResponseCache(size_t max_bytes)
+	: m_max_bytes(max_bytes),
+	  m_max_shard_bytes(max_bytes / NUM_SHARDS)
+{
+}
+
+ResponseCache::Result ResponseCache::lookup(const std::string& key, response_ptr& result)
+{
+	auto& shard = shard_for(key);
+	const auto now = clock::now();
+	std::lock_guard<std::mutex> lock(shard.mtx);
+
+	auto it = shard.map.find(key);
+	if (it == shard.map.end()) {
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		return Result::Miss;
+	}
+	auto entry = it->second;
+	if (now < entry->fresh_until) {
+		shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+		result = entry->response;
+		m_hits.fetch_add(1, std::memory_order_relaxed);
+		return Result::Fresh;
+	}
+	if (now < entry->grace_until) {
+		/* The first request to see a stale object refreshes it. */
+		if (!entry->refreshing) {
+			entry->refreshing = true;
+			m_misses.fetch_add(1, std::memory_order_relaxed);
+			return Result::Miss;
+		}
+		shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+		result = entry->response;
+		m_stale_hits.fetch_add(1, std::memory_order_relaxed);
+		return Result::Stale;
+	}
+	if (now >= entry->keep_until) {
+		this->erase(shard, entry);
+		m_expirations.fetch_add(1, std::memory_order_relaxed);
+	}
+	m_misses.fetch_add(1, std::memory_order_relaxed);
+	return Result::Miss;
+}
+
+ResponseCache::response_ptr ResponseCache::lookup_kept(const std::string& key)
+{
+	auto& shard = shard_for(key);
+	const auto now = clock::now();
+	std::lock_guard<std::mutex> lock(shard.mtx);
+
+	auto it = shard.map.find(key);
+	if (it == shard.map.end() || now >= it->second->keep_until) {
+		return nullptr;
+	}
+	m_kept_hits.fetch_add(1, std::memory_order_relaxed);
+	return it->second->response;
+}
+
+void ResponseCache::insert(const std::string& key, response_ptr response,
+	uint32_t ttl_ms, uint32_t grace_ms, uint32_t keep_ms)
+{
+	size_t size = 2 * key.size() + response->content_type.size()
+		+ response->body.size() + ENTRY_OVERHEAD;
+	for (const auto& header : response->headers) {
+		size += header.first.size() + header.second.size();
+	}
+	if (size > m_max_shard_bytes || ttl_ms + uint64_t(grace_ms) + keep_ms == 0)
+		return;
+
+	auto& shard = shard_for(key);
+	const auto now = clock::now();
+	std::lock_guard<std::mutex> lock(shard.mtx);
+
+	if (auto it = shard.map.find(key); it != shard.map.end()) {
+		this->erase(shard, it->second);
+	}
+	/* Evict least recently used objects until the new one fits. */
+	while (shard.bytes + size > m_max_shard_bytes && !shard.lru.empty()) {
+		this->erase(shard, std::prev(shard.lru.end()));
+		m_evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.response = std::move(response);
+	entry.size = size;
+	entry.fresh_until = now + std::chrono::milliseconds(ttl_ms);
+	entry.grace_until = entry.fresh_until + std::chrono::milliseconds(grace_ms);
+	entry.keep_until  = entry.grace_until + std::chrono::milliseconds(keep_ms);
+	shard.lru.push_front(std::move(entry));
+	shard.map.emplace(key, shard.lru.begin());
+	shard.bytes += size;
+	m_inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+ResponseCache::Coalesce ResponseCache::coalesce(const std::string& key,
+	std::chrono::milliseconds max_wait, response_ptr& result)
+{
+	auto& shard = shard_for(key);
+	std::unique_lock<std::mutex> lock(shard.mtx);
+
+	auto [it, inserted] = shard.busy.try_emplace(key);
+	if (inserted) {
+		it->second = std::make_shared<Busy>();
+		return Coalesce::First;
+	}
+	/* Keep the busy object alive, as the first request erases it. */
+	auto busy = it->second;
+	if (!busy->cv.wait_for(lock, max_wait, [&] { return busy->done; })) {
+		m_coalesce_timeouts.fetch_add(1, std::memory_order_relaxed);
+		return Coalesce::Proceed;
+	}
+
+	auto mit = shard.map.find(key);
+	if (mit != shard.map.end() && clock::now() < mit->second->grace_until) {
+		shard.lru.splice(shard.lru.begin(), shard.lru, mit->second);
+		result = mit->second->response;
+		m_coalesced.fetch_add(1, std::memory_order_relaxed);
+		return Coalesce::Response;
+	}
+	return Coalesce::Proceed;
+}
+
+void ResponseCache::coalesce_done(const std::string& key)
+{
+	auto& shard = shard_for(key);
+	std::lock_guard<std::mutex> lock(shard.mtx);
+
+	auto it = shard.busy.find(key);
+	if (it != shard.busy.end()) {
+		it->second->done = true;
+		it->second->cv.notify_all();
+		shard.busy.erase(it);
+	}
+}
+
+void ResponseCache::erase(Shard& shard, lru_list::iterator entry)
+{
+	shard.bytes -= entry->size;
+	shard.map.erase(entry->key);
+	shard.lru.erase(entry);
+}
+
+void ResponseCache::gather_stats(nlohmann::json& j)
+{
+	size_t bytes = 0;
+	size_t objects = 0;
+	for (auto& shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		bytes   += shard.bytes;
+		objects += shard.map.size();
+	}
+	j = {
+		{"hits",        m_hits.load(std::memory_order_relaxed)},
+		{"stale_hits",  m_stale_hits.load(std::memory_order_relaxed)},
+		{"kept_hits",   m_kept_hits.load(std::memory_order_relaxed)},
+		{"misses",      m_misses.load(std::memory_order_relaxed)},
+		{"inserts",     m_inserts.load(std::memory_order_relaxed)},
+		{"evictions",   m_evictions.load(std::memory_order_relaxed)},
+		{"expirations", m_expirations.load(std::memory_order_relaxed)},
+		{"coalesced",   m_coalesced.load(std::memory_order_relaxed)},
+		{"coalesce_timeouts", m_coalesce_timeouts.load(std::memory_order_relaxed)},
+		{"objects",     objects},
+		{"bytes",       bytes},
+		{"max_bytes",   m_max_bytes}
+	};
+}
+
+} // kvm
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace kvm {
+
+/* A complete response, as produced by a tenant's program. */
+struct CachedResponse {
+	uint16_t    status = 200;
+	std::string content_type;
+	std::string body;
+	std::vector<std::pair<std::string, std::string>> headers;
+};
+
+/**
+ * ResponseCache holds responses that a tenant's program marked as
+ * cacheable with set_cacheable(ttl, grace, keep). Hits are delivered
+ * without reserving a VM. The cache is split into shards, each with
+ * its own lock and LRU list, and the tenant's memory limit is divided
+ * evenly between them.
+ *
+ * An object is fresh for TTL. During grace it is still delivered, while
+ * exactly one request is let through to refresh it. During keep it is
+ * only delivered instead of an error from the program.
+**/
+class ResponseCache {
+public:
+	using clock = std::chrono::steady_clock;
+	using response_ptr = std::shared_ptr<const CachedResponse>;
+	static constexpr size_t NUM_SHARDS = 16;
+
+	enum class Result { Miss, Fresh, Stale };
+
+	/* Find a deliverable response for key. */
+	Result lookup(const std::string& key, response_ptr& result);
+	/* Find a response that is past grace, but still kept. */
+	response_ptr lookup_kept(const std::string& key);
+
+	void insert(const std::string& key, response_ptr response,
+		uint32_t ttl_ms, uint32_t grace_ms, uint32_t keep_ms);
+
+	/* Coalescing of identical misses: The first request for a key
+	   computes the response, and later ones wait for it to be inserted,
+	   for at most max_wait. Proceed means the waiter gave up, or that
+	   the response was not cacheable, and it must compute it itself.
+	   The first request must call coalesce_done() when finished. */
+	enum class Coalesce { First, Response, Proceed };
+	Coalesce coalesce(const std::string& key,
+		std::chrono::milliseconds max_wait, response_ptr& result);
+	void coalesce_done(const std::string& key);
+
+	size_t max_bytes() const noexcept { return m_max_bytes; }
+	void gather_stats(nlohmann::json& j);
+
+	ResponseCache(size_t max_bytes);
+
+private:
+	struct Entry {
+		std::string  key;
+		response_ptr response;
+		size_t       size;
+		clock::time_point fresh_until;
+		clock::time_point grace_until;
+		clock::time_point keep_until;
+		bool         refreshing = false;
+	};
+	using lru_list = std::list<Entry>;
+	/* An in-flight miss that other requests are waiting on. */
+	struct Busy {
+		std::condition_variable cv;
+		bool done = false;
+	};
+	struct Shard {
+		std::mutex mtx;
+		lru_list   lru; /* Most recently used first */
+		std::unordered_map<std::string, lru_list::iterator> map;
+		std::unordered_map<std::string, std::shared_ptr<Busy>> busy;
+		size_t     bytes = 0;
+	};
+	Shard& shard_for(const std::string& key) {
+		return m_shards[std::hash<std::string>{}(key) % NUM_SHARDS];
+	}
+	void erase(Shard&, lru_list::iterator);
+
+	std::array<Shard, NUM_SHARDS> m_shards;
+	const size_t m_max_bytes;
+	const size_t m_max_shard_bytes;
+
+	std::atomic<uint64_t> m_hits {0};
+	std::atomic<uint64_t> m_stale_hits {0};
+	std::atomic<uint64_t> m_kept_hits {0};
+	std::atomic<uint64_t> m_misses {0};
+	std::atomic<uint64_t> m_inserts {0};
+	std::atomic<uint64_t> m_evictions {0};
+	std::atomic<uint64_t> m_expirations {0};
+	std::atomic<uint64_t> m_coalesced {0};
+	std::atomic<uint64_t> m_coalesce_timeouts {0};
+};
+
+} // kvm
@@ -0,0 +1,134 @@
+#include "router.hpp"
+#include <algorithm>
+
+namespace kvm {
+
+static char to_lower(char c) noexcept
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Remove the port, if any, from a Host header: host:port or [ipv6]:port. */
+static std::string_view strip_port(std::string_view host) noexcept
+{
+	if (!host.empty() && host.front() == '[') {
+		const auto end = host.find(']');
+		return (end != std::string_view::npos) ? host.substr(0, end + 1) : host;
+	}
+	return host.substr(0, host.find(':'));
+}
+
+void Router::append_host(std::string& out, std::string_view host)
+{
+	host = strip_port(host);
+	const size_t start = out.size();
+	out.append(host);
+	std::transform(out.begin() + start, out.end(), out.begin() + start, to_lower);
+}
+
+bool Router::add(std::string_view route, TenantInstance* tenant)
+{
+	const auto slash = route.find('/');
+	std::string host { strip_port(route.substr(0, slash)) };
+	std::string prefix;
+	if (slash != std::string_view::npos) {
+		prefix = route.substr(slash);
+		/* A trailing slash is implied by the prefix matching. */
+		while (prefix.size() > 1 && prefix.back() == '/')
+			prefix.pop_back();
+		if (prefix == "/")
+			prefix.clear();
+	}
+	std::transform(host.begin(), host.end(), host.begin(), to_lower);
+
+	auto* routes = &m_exact_routes;
+	if (host.size() > 2 && host[0] == '*' && host[1] == '.') {
+		host.erase(0, 1);
+		routes = &m_wildcard_routes;
+	}
+	if (host.empty() || host.size() > MAX_HOST || host.find('*') != std::string::npos)
+		return false;
+
+	auto& paths = (*routes)[host];
+	for (const auto& path : paths) {
+		if (path.prefix == prefix)
+			return false;
+	}
+	paths.push_back(Path{std::move(prefix), tenant});
+	return true;
+}
+
+void Router::flatten(std::map<std::string, std::vector<Path>>& routes, std::vector<Host>& hosts)
+{
+	hosts.reserve(routes.size());
+	/* The map is already sorted by host name. */
+	for (auto& it : routes) {
+		auto& paths = it.second;
+		std::stable_sort(paths.begin(), paths.end(),
+			[] (const Path& a, const Path& b) { return a.prefix.size() > b.prefix.size(); });
+		hosts.push_back(Host{it.first, uint32_t(m_paths.size()), uint32_t(paths.size())});
+		for (auto& path : paths)
+			m_paths.push_back(std::move(path));
+	}
+	routes.clear();
+}
+
+void Router::compile()
+{
+	this->flatten(m_exact_routes, m_exact);
+	this->flatten(m_wildcard_routes, m_wildcard);
+	m_paths.shrink_to_fit();
+}
+
+const Router::Host* Router::find_host(const std::vector<Host>& hosts, std::string_view name) noexcept
+{
+	auto it = std::lower_bound(hosts.begin(), hosts.end(), name,
+		[] (const Host& host, std::string_view name) { return std::string_view(host.name) < name; });
+	if (it != hosts.end() && it->name == name)
+		return &*it;
+	return nullptr;
+}
+
+TenantInstance* Router::find_path(const Host& host, std::string_view path) const noexcept
+{
+	for (uint32_t i = 0; i < host.num_paths; i++) {
+		const auto& route = m_paths[host.first_path + i];
+		const auto& prefix = route.prefix;
+		/* Prefixes match whole path segments: /api matches /api/v1, but not /apis */
+		if (path.starts_with(prefix)
+			&& (path.size() == prefix.size() || prefix.empty() || path[prefix.size()] == '/'))
+			return route.tenant;
+	}
+	return nullptr;
+}
+
+TenantInstance* Router::find(std::string_view host, std::string_view path) const noexcept
+{
+	host = strip_port(host);
+	if (host.empty() || host.size() > MAX_HOST)
+		return nullptr;
+
+	/* Hosts are compared in lower case, which rarely needs a copy. */
+	char buffer[MAX_HOST];
+	if (std::any_of(host.begin(), host.end(), [] (char c) { return c >= 'A' && c <= 'Z'; })) {
+		std::transform(host.begin(), host.end(), buffer, to_lower);
+		host = std::string_view(buffer, host.size());
+	}
+
+	if (const Host* exact = find_host(m_exact, host)) {
+		if (auto* tenant = find_path(*exact, path))
+			return tenant;
+	}
+	/* Wildcards from the longest domain to the shortest. */
+	if (!m_wildcard.empty()) {
+		for (size_t dot = host.find('.'); dot != std::string_view::npos; dot = host.find('.', dot + 1)) {
+			if (const Host* wildcard = find_host(m_wildcard, host.substr(dot))) {
+				if (auto* tenant = find_path(*wildcard, path))
+					return tenant;
+			}
+		}
+	}
+	return nullptr;
+}
+
+} // kvm
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kvm {
+class TenantInstance;
+
+/**
+ * Router finds the tenant for a request from its Host header and path.
+ * Routes are compiled into flat, sorted tables once, and a router is
+ * never changed after that. When the tenants change, a new router is
+ * built and swapped in. Lookups do not allocate, and do not hash.
+ *
+ * A route is an exact host (example.com), or a wildcard (*.example.com)
+ * that matches any subdomain, optionally followed by a path prefix
+ * (example.com/api). Hosts are matched case-insensitively and without
+ * the port. Exact hosts are tried before wildcards, longer wildcards
+ * before shorter ones, and longer path prefixes before shorter ones.
+**/
+class Router {
+public:
+	static constexpr size_t MAX_HOST = 255;
+
+	/* Returns false if the route is invalid, or already taken. */
+	bool add(std::string_view route, TenantInstance* tenant);
+	/* Build the lookup tables. No routes can be added after this. */
+	void compile();
+
+	TenantInstance* find(std::string_view host, std::string_view path) const noexcept;
+	/* Append a Host header as it is matched: lower case, without the port. */
+	static void append_host(std::string& out, std::string_view host);
+
+	size_t size() const noexcept { return m_paths.size(); }
+
+private:
+	struct Path {
+		std::string prefix; /* Empty matches every path */
+		TenantInstance* tenant;
+	};
+	struct Host {
+		std::string name; /* Wildcards are stored as .example.com */
+		uint32_t first_path;
+		uint32_t num_paths;
+	};
+	static const Host* find_host(const std::vector<Host>&, std::string_view) noexcept;
+	TenantInstance* find_path(const Host&, std::string_view path) const noexcept;
+	void flatten(std::map<std::string, std::vector<Path>>&, std::vector<Host>&);
+
+	/* Routes before compilation */
+	std::map<std::string, std::vector<Path>> m_exact_routes;
+	std::map<std::string, std::vector<Path>> m_wildcard_routes;
+
+	std::vector<Host> m_exact;
+	std::vector<Host> m_wildcard;
+	std::vector<Path> m_paths;
+};
+
+} // kvm
@@ -25,5 +25,7 @@ struct SerializedState {
 	   NOTE: Limiting the entries to lower 32-bits, for now. */
 	std::array<uint32_t, (size_t)ProgramEntryIndex::TOTAL_ENTRIES> entry_address {};
 	uint64_t inputs_allocation = 0;
+	/* Batch size, when the program waits for batches of requests. */
+	uint16_t request_batch_max = 0;
 };
 }
\ No newline at end of file
@@ -18,6 +18,26 @@ namespace kvm
     static constexpr float  REQUEST_VM_TIMEOUT = 8.0f;
     static constexpr float  STREAM_HANDLING_TIMEOUT = 2.0f;
     static constexpr float  ERROR_HANDLING_TIMEOUT = 1.0f;
+    static constexpr uint16_t MAX_REQUEST_BATCH = 64;
+    /* Request VMs are placed on, and reserved from, up to this many nodes */
+    static constexpr int    MAX_NUMA_NODES = 4;
+    /* Wait for a VM on the local node before stealing from other nodes */
+    static constexpr uint32_t NUMA_LOCAL_WAIT_US = 500;
+    /* Elastic request VM pools are resized this often */
+    static constexpr uint32_t AUTOSCALE_INTERVAL_MS = 1000;
+    /* Tenants with hibernate_after are checked for idleness this often */
+    static constexpr uint32_t HIBERNATE_CHECK_INTERVAL_MS = 1000;
+    /* Request threads let go of the sticky VMs of hibernated and idle
+       tenants this often, also when they see no requests. Under memory
+       pressure, also of tenants that saw no requests in the meantime. */
+    static constexpr uint32_t SLOT_SWEEP_INTERVAL_MS = 1000;
+    /* Memory is reclaimed above the high watermark of the memory budget,
+       until below the low watermark */
+    static constexpr float    MEMORY_HIGH_WATERMARK = 0.90f;
+    static constexpr float    MEMORY_LOW_WATERMARK  = 0.80f;
+    static constexpr uint32_t MEMORY_GOVERNOR_INTERVAL_MS = 250;
+    /* Tenants are only hibernated for memory after this long without requests */
+    static constexpr uint32_t MEMORY_HIBERNATE_MIN_IDLE_MS = 10000;
 
     /* Serialized storage VM access */
     static constexpr int    STORAGE_VM_NICE = 10;
@@ -16,7 +16,7 @@ using namespace tinykvm;
 #define SYSPRINT(fmt, ...) /* */
 #endif
 
-//#include "system_calls_http.cpp"
+#include "system_calls_http.cpp"
 //#include "system_calls_regex.cpp"
 #include "system_calls_fetch.cpp"
 #include "system_calls_api.cpp"
@@ -70,6 +70,9 @@ void MachineInstance::setup_syscall_interface()
 			case 0x10002: // PAUSE_FOR_REQUESTS
 				syscall_pause_for_requests(cpu, inst);
 				return;
+			case 0x10003: // PAUSE_FOR_REQUEST_BATCH
+				syscall_pause_for_request_batch(cpu, inst);
+				return;
 			case 0x10005: // SET_CACHEABLE
 				syscall_set_cacheable(cpu, inst);
 				return;
@@ -86,16 +89,16 @@ void MachineInstance::setup_syscall_interface()
 				syscall_storage_noreturn(cpu, inst);
 				return;
 			case 0x10020: // HTTP_APPEND
-				//syscall_http_append(cpu, inst);
+				syscall_http_append(cpu, inst);
 				return;
 			case 0x10021: // HTTP_SET
-				//syscall_http_set(cpu, inst);
+				syscall_http_set(cpu, inst);
 				return;
 			case 0x10022: // HTTP_FIND
-				//syscall_http_find(cpu, inst);
+				syscall_http_find(cpu, inst);
 				return;
 			case 0x10023: // HTTP_METHOD
-				//syscall_http_method(cpu, inst);
+				syscall_http_method(cpu, inst);
 				return;
 			case 0x10030: // REGEX_COMPILE
 				//syscall_regex_compile(cpu, inst);
@@ -42,6 +42,24 @@ static void syscall_pause_for_requests(vCPU& cpu, MachineInstance& inst)
 		throw std::runtime_error("wait_for_requests(): Cannot be called after initialization");
 	}
 }
+static void syscall_pause_for_request_batch(vCPU& cpu, MachineInstance& inst)
+{
+	if (inst.is_waiting_for_requests() == false) {
+		// The batch size is in struct kvm_request_batch (RDI)
+		uint16_t max = 0;
+		cpu.machine().copy_from_guest(&max, cpu.registers().rdi + 16, sizeof(max));
+		if (UNLIKELY(max == 0 || max > MAX_REQUEST_BATCH)) {
+			throw std::runtime_error("wait_for_requests_batch(): Invalid batch size");
+		}
+		if (UNLIKELY(inst.request_batch_max() != 0 && inst.request_batch_max() != max)) {
+			throw std::runtime_error("wait_for_requests_batch(): Batch size cannot change");
+		}
+		inst.wait_for_request_batch_paused(max);
+		cpu.stop();
+	} else {
+		throw std::runtime_error("wait_for_requests_batch(): Cannot be called after initialization");
+	}
+}
 
 static void syscall_backend_response(vCPU& cpu, MachineInstance& inst)
 {
@@ -121,7 +139,21 @@ static void syscall_ipre_resume_storage(vCPU& cpu, MachineInstance& inst)
 static void syscall_set_cacheable(vCPU& cpu, MachineInstance& inst)
 {
 	auto& regs = cpu.registers();
-	regs.rax = -1;
+	// Only request VMs of tenants with a response cache
+	if (inst.tenant().response_cache != nullptr && !inst.is_storage()) {
+		auto duration = [] (int64_t ms) -> uint32_t {
+			return std::clamp<int64_t>(ms, 0, UINT32_MAX);
+		};
+		inst.set_cacheable({
+			.cached   = regs.rdi != 0,
+			.ttl_ms   = duration(regs.rsi),
+			.grace_ms = duration(regs.rdx),
+			.keep_ms  = duration(regs.rcx),
+		});
+		regs.rax = 0;
+	} else {
+		regs.rax = -1;
+	}
 	cpu.set_registers(regs);
 }
 
@@ -1,7 +1,100 @@
 #include <cstdint>
+#include "http_fields.hpp"
 
 namespace kvm {
+static constexpr size_t HTTP_FIELD_MAX = 8192;
 
+static void syscall_http_append(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const int      where   = regs.rdi;
+	const uint64_t g_field = regs.rsi;
+	const size_t   len     = regs.rdx;
+	auto* http = inst.http_fields();
+	if (http != nullptr && len <= HTTP_FIELD_MAX) {
+		const std::string field = cpu.machine().buffer_to_string(g_field, len);
+		std::string_view key, value;
+		if (HttpFields::split_field(field, key, value)) {
+			regs.rax = http->append(where, key, value) ? 0 : -1;
+		} else {
+			regs.rax = -1;
+		}
+	} else {
+		regs.rax = -1;
+	}
+	cpu.set_registers(regs);
+}
 
+static void syscall_http_set(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const int      where   = regs.rdi;
+	const uint64_t g_field = regs.rsi;
+	const size_t   len     = regs.rdx;
+	auto* http = inst.http_fields();
+	if (http != nullptr && len <= HTTP_FIELD_MAX) {
+		const std::string field = cpu.machine().buffer_to_string(g_field, len);
+		std::string_view key, value;
+		// A field without a colon unsets the key
+		if (HttpFields::split_field(field, key, value)) {
+			regs.rax = http->set(where, key, value) ? 0 : -1;
+		} else {
+			regs.rax = http->unset(where, key) ? 0 : -1;
+		}
+	} else {
+		regs.rax = -1;
+	}
+	cpu.set_registers(regs);
+}
+
+static void syscall_http_find(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const int      where = regs.rdi;
+	const uint64_t g_key = regs.rsi;
+	const size_t   klen  = regs.rdx;
+	const uint64_t g_out = regs.rcx;
+	const size_t   olen  = regs.r8;
+	auto* http = inst.http_fields();
+	std::string_view value;
+	if (http != nullptr && klen <= HTTP_FIELD_MAX
+		&& http->find(where, cpu.machine().buffer_to_string(g_key, klen), value))
+	{
+		if (g_out == 0x0) {
+			// Only the length was asked for
+			regs.rax = value.size();
+		} else if (value.size() <= olen) {
+			cpu.machine().copy_to_guest(g_out, value.data(), value.size());
+			regs.rax = value.size();
+		} else {
+			regs.rax = 0;
+		}
+	} else {
+		regs.rax = 0;
+	}
+	cpu.set_registers(regs);
+}
+
+static void syscall_http_method(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const uint64_t g_out = regs.rdi;
+	const size_t   olen  = regs.rsi;
+	auto* http = inst.http_fields();
+	if (http != nullptr) {
+		const std::string_view method = http->method();
+		if (g_out == 0x0) {
+			regs.rax = method.size();
+		} else if (method.size() <= olen) {
+			cpu.machine().copy_to_guest(g_out, method.data(), method.size());
+			regs.rax = method.size();
+		} else {
+			regs.rax = 0;
+		}
+	} else {
+		regs.rax = 0;
+	}
+	cpu.set_registers(regs);
+}
 
 } // kvm
@@ -31,9 +31,18 @@ TenantConfig::TenantConfig(
 		// Use default concurrency
 		this->group.max_concurrency = std::thread::hardware_concurrency();
 	}
+	// Without a minimum, lazy forking starts with a single VM and forks
+	// the rest on demand. Otherwise the pool is not elastic.
+	if (this->group.min_concurrency == 0 && g_settings.lazy_forking) {
+		this->group.min_concurrency = 1;
+	}
+	if (this->group.min_concurrency == 0 || this->group.min_concurrency > this->group.max_concurrency) {
+		this->group.min_concurrency = this->group.max_concurrency;
+	}
 	// If double_buffered is enabled, we need double the concurrency
 	if (this->group.double_buffered) {
 		this->group.max_concurrency *= 2;
+		this->group.min_concurrency *= 2;
 	}
 }
 TenantConfig::~TenantConfig() {}
@@ -189,6 +198,16 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 		// requests faster due to not having to create memory banks.
 		group.set_limit_workmem_after_req(obj.value());
 	}
+	else if (obj.key() == "adaptive_working_memory")
+	{
+		// Keep as much memory after request completion as requests use,
+		// between min_req_mem_after_reset and req_mem_limit_after_reset.
+		group.adaptive_working_memory = obj.value();
+	}
+	else if (obj.key() == "min_req_mem_after_reset")
+	{
+		group.min_limit_req_mem = uint64_t(obj.value()) * 1048576ul;
+	}
 	else if (obj.key() == "shared_memory")
 	{
 		// Sets the size of shared memory between VMs.
@@ -221,14 +240,73 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 	{
 		group.heap_address_hint = uint32_t(obj.value()) * 1048576ul;
 	}
+	else if (obj.key() == "cache_memory")
+	{
+		// Enables the response cache, limited to this many megabytes.
+		group.max_cache_memory = uint64_t(obj.value()) * 1048576ul;
+	}
+	else if (obj.key() == "cache_coalesce_wait")
+	{
+		// Identical cache misses wait this long for the first one.
+		group.cache_coalesce_wait = obj.value();
+	}
+	else if (obj.key() == "cache_vary")
+	{
+		// Request headers that select between cached responses.
+		group.cache_vary = obj.value().template get<std::vector<std::string>>();
+	}
+	else if (obj.key() == "max_queue_time")
+	{
+		// Requests that cannot get a VM in time are turned away early.
+		group.max_queue_time = obj.value().template get<float>();
+	}
+	else if (obj.key() == "priority_header")
+	{
+		group.priority_header = obj.value();
+	}
+	else if (obj.key() == "priority_weights")
+	{
+		auto weights = obj.value().template get<std::vector<float>>();
+		if (weights.size() != group.priority_weights.size())
+			throw std::runtime_error("priority_weights must have one weight per priority (4)");
+		for (size_t i = 0; i < weights.size(); i++) {
+			if (!(weights[i] > 0.0f))
+				throw std::runtime_error("priority_weights must be positive");
+			group.priority_weights[i] = weights[i];
+		}
+	}
+	else if (obj.key() == "max_borrow_time")
+	{
+		// With fewer VMs than threads, requests wait this long for a VM.
+		group.max_borrow_time = obj.value();
+	}
 	else if (obj.key() == "concurrency")
 	{
 		group.max_concurrency = obj.value();
 	}
+	else if (obj.key() == "min_concurrency")
+	{
+		// Request VMs beyond this are forked on demand.
+		group.min_concurrency = obj.value();
+	}
+	else if (obj.key() == "vm_idle_timeout")
+	{
+		group.vm_idle_timeout = obj.value();
+	}
+	else if (obj.key() == "hibernate_after")
+	{
+		// Idle tenants are torn down, and brought back by the next request.
+		group.hibernate_after = obj.value();
+	}
 	else if (obj.key() == "double_buffered")
 	{
 		group.double_buffered = obj.value();
 	}
+	else if (obj.key() == "dedicated_vm_threads")
+	{
+		// Slow resets would delay the VMs of other tenants on a shared worker.
+		group.dedicated_vm_threads = obj.value();
+	}
 	else if (obj.key() == "storage")
 	{
 		group.has_storage = obj.value();
@@ -326,6 +404,12 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 		group.ephemeral = group.ephemeral || obj.value();
 		group.ephemeral_keep_working_memory = obj.value();
 	}
+	else if (obj.key() == "eager_headers")
+	{
+		// When disabled, request header fields are not copied into the
+		// guest up front, and are instead looked up with http_find().
+		group.eager_headers = obj.value();
+	}
 	else if (obj.key() == "main_arguments")
 	{
 		auto& vec = group.main_arguments;
@@ -536,6 +620,7 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 	else if (obj.key() == "uri")   { /* Silently ignore. */ }
 	else if (obj.key() == "filename") { /* Silently ignore. */ }
 	else if (obj.key() == "storage_filename") { /* Silently ignore. */ }
+	else if (obj.key() == "routes") { /* Silently ignore. */ }
 	else if (obj.key() == "default") { /* Silently ignore. */ }
 	else if (obj.key() == "start") { /* Silently ignore. */ }
 	else
@@ -581,6 +666,9 @@ void Tenants::init_tenants(
 			grit = ret.first;
 		}
 		auto& group = grit->second;
+		if (obj.contains("routes")) {
+			throw std::runtime_error("Routes are set per tenant, not in group " + grname);
+		}
 
 		// Set group settings
 		for (auto it = obj.begin(); it != obj.end(); ++it) {
@@ -649,17 +737,24 @@ void Tenants::init_tenants(
 			}
 
 			/* Use the group data except filename */
-			this->load_tenant(kvm::TenantConfig{
+			kvm::TenantConfig config {
 				it.key(),
 				std::move(filename),
 				std::move(storage_filename),
 				std::move(lvu_key),
 				std::move(group),
 				std::move(uri)
-			}, initialize_or_configured_to_start);
+			};
+			/* Extra hosts, wildcards and path prefixes for the tenant. */
+			if (obj.contains("routes")) {
+				config.routes = obj["routes"].template get<std::vector<std::string>>();
+			}
+			this->load_tenant(config, initialize_or_configured_to_start);
 		}
 	}
 
+	this->build_router();
+
 	/* Skip initialization here if not @initialize.
 	   NOTE: Early return.  */
 	if (initialize == false)
@@ -693,6 +788,33 @@ TenantInstance* Tenants::find(const std::string& name)
 	return nullptr;
 }
 
+void Tenants::build_router()
+{
+	std::lock_guard<std::mutex> lock(m_router_mtx);
+	auto router = std::make_unique<Router>();
+	auto add = [&] (const std::string& route, TenantInstance* tenant) {
+		if (!router->add(route, tenant)) {
+			fprintf(stderr, "kvm: Route '%s' for tenant '%s' is invalid or already taken\n",
+				route.c_str(), tenant->config.name.c_str());
+		}
+	};
+	/* Tenant names are hosts too. */
+	for (auto& it : this->m_tenants) {
+		add(it.second.config.name, &it.second);
+	}
+	for (auto& it : this->m_tenants) {
+		for (const auto& route : it.second.config.routes)
+			add(route, &it.second);
+	}
+	/* Requests straight to the listening address go to the default tenant. */
+	if (auto* tenant = this->find(g_settings.default_tenant)) {
+		add(g_settings.host, tenant);
+	}
+	router->compile();
+	this->m_router.store(router.get(), std::memory_order_release);
+	this->m_routers.push_back(std::move(router));
+}
+
 void Tenants::foreach(foreach_t func)
 {
 	for (auto& it : this->m_tenants) {
@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <cstdint>
 #include <functional>
 #include <map>
@@ -21,11 +22,12 @@ struct TenantGroup {
 	float    max_boot_time; /* Seconds */
 	float    max_req_time; /* Seconds */
 	float    max_storage_time; /* Seconds */
-	uint32_t max_queue_time; /* Seconds */
+	float    max_queue_time; /* Seconds */
 	uint64_t max_address_space; /* Megabytes */
 	uint64_t max_main_memory; /* Megabytes */
 	uint32_t max_req_mem; /* Megabytes */
 	uint32_t limit_req_mem; /* Megabytes of memory banks to keep after request completion */
+	uint64_t min_limit_req_mem = 0; /* Bytes kept at least, with adaptive_working_memory */
 	uint32_t shared_memory; /* Megabytes */
 	uint64_t dylink_address_hint = 0x200000; /* Image base address hint */
 	uint64_t heap_address_hint = 0; /* Address hint for the heap */
@@ -33,7 +35,13 @@ struct TenantGroup {
 	uint64_t storage_dylink_address_hint = 0x2000200000; /* Image base address hint for storage */
 	uint64_t hugepage_arena_size = 0; /* Megabytes */
 	uint64_t hugepage_requests_arena = 0; /* Megabytes */
+	uint64_t max_cache_memory = 0; /* Megabytes of cached responses, 0 = no cache */
+	float    cache_coalesce_wait = 1.0f; /* Seconds, 0 = no request coalescing */
 	size_t   max_concurrency = 2; /* Request VMs */
+	size_t   min_concurrency = 0; /* Request VMs kept when idle, 0 = max_concurrency, or 1 with --lazy-forking */
+	float    vm_idle_timeout = 60.0f; /* Seconds before idle request VMs are released */
+	float    max_borrow_time = 2.0f; /* Seconds to wait for a VM, when fewer VMs than threads */
+	float    hibernate_after = 0.0f; /* Seconds without requests before the tenant is hibernated, 0 = never */
 	size_t   max_smp         = 0; /* Multi-processing per VM */
 	size_t   max_regex    = 64;
 	bool     has_storage  = false;
@@ -41,6 +49,7 @@ struct TenantGroup {
 	bool     storage_perm_remote = false; /* Storage VM is permanently connected to request VM */
 	bool     storage_serialized = true; /* Only one storage call at a time */
 	bool     double_buffered = false; /* Use double-buffering for resets */
+	bool     dedicated_vm_threads = false; /* Each request VM has its own worker thread, for slow resets */
 	bool     hugepages    = false;
 	bool     split_hugepages = true;
 	bool     transparent_hugepages = false;
@@ -49,6 +58,8 @@ struct TenantGroup {
 	bool     control_ephemeral = false;
 	bool     ephemeral = true;
 	bool     ephemeral_keep_working_memory = true;
+	bool     adaptive_working_memory = false; /* Learn how much memory to keep after request completion */
+	bool     eager_headers = true; /* Copy all request headers into backend inputs */
 	bool     print_stdout = true; /* Print directly to stdout */
 	bool     verbose = false;
 	bool     verbose_syscalls = false;
@@ -76,6 +87,14 @@ struct TenantGroup {
 	uint16_t websocket_systems = 0;
 	std::string ws_server_address;
 
+	/* Request headers that are part of the response cache key, which
+	   always has the method, the Host (normalized) and the URL. */
+	std::vector<std::string> cache_vary;
+	/* Request header with the priority of the request, 0 (highest) to 3.
+	   Waiting requests get VMs in proportion to the weight of their priority. */
+	std::string priority_header;
+	std::array<float, 4> priority_weights { 8.0f, 4.0f, 2.0f, 1.0f };
+
 	std::vector<std::string> environ {
 		"LC_TYPE=C", "LC_ALL=C", "USER=root"
 	};
@@ -112,6 +131,9 @@ struct TenantGroup {
 		return (this->server_port != 0 || !this->server_address.empty()) &&
 		       this->epoll_systems > 0;
 	}
+	bool is_elastic() const noexcept {
+		return this->min_concurrency < this->max_concurrency;
+	}
 	bool has_websocket_system() const noexcept {
 		return (this->ws_server_port != 0 || !this->ws_server_address.empty()) &&
 		       this->websocket_systems > 0;
@@ -185,6 +207,10 @@ struct TenantConfig
 
 	/* One allowed file for persistence / state-keeping */
 	std::string allowed_file;
+	/* Hosts (example.com, *.example.com) and path prefixes (example.com/api)
+	   that are routed to the tenant, in addition to its name. Not a group
+	   setting, as every tenant of a group would claim the same routes. */
+	std::vector<std::string> routes;
 	/* The filename the guest will use to access the allowed file. */
 	static const std::string guest_state_file;
 };
@@ -18,8 +18,10 @@
 
 #include "common_defs.hpp"
 #include "program_instance.hpp"
+#include "scoped_duration.hpp"
 #include "time_format.hpp"
 #include <cstdarg>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -34,6 +36,10 @@ TenantInstance::TenantInstance(const TenantConfig& conf, bool start_initialize)
 		init = true;
 		MachineInstance::kvm_initialize();
 	}
+	if (config.group.max_cache_memory > 0) {
+		this->response_cache =
+			std::make_unique<ResponseCache>(config.group.max_cache_memory);
+	}
 
 	if (start_initialize)
 		this->begin_initialize();
@@ -152,7 +158,7 @@ std::shared_ptr<ProgramInstance> TenantInstance::wait_for_initialization()
 	return prog;
 }
 
-VMPoolItem* TenantInstance::vmreserve(bool debug)
+VMPoolItem* TenantInstance::vmreserve(bool debug, VMAdmission* adm)
 {
 	try
 	{
@@ -161,8 +167,9 @@ VMPoolItem* TenantInstance::vmreserve(bool debug)
 			return nullptr;
 
 		// Reserve a machine through blocking queue.
-		// May throw if dequeue from the queue times out.
-		Reservation resv = prog->reserve_vm(this, std::move(prog));
+		// Returns nullptr if dequeue from the queue times out.
+		VMAdmission admission;
+		Reservation resv = prog->reserve_vm(this, std::move(prog), adm ? *adm : admission);
 		// prog is nullptr after this ^
 		return (VMPoolItem*) resv.slot;
 
@@ -173,6 +180,33 @@ VMPoolItem* TenantInstance::vmreserve(bool debug)
 	}
 }
 
+VMPoolItem* TenantInstance::vmborrow(VMAdmission* adm)
+{
+	try
+	{
+		auto prog = this->ref(false);
+		if (UNLIKELY(prog == nullptr))
+			return nullptr;
+
+		VMAdmission admission;
+		Reservation resv = prog->borrow_vm(this, std::move(prog), adm ? *adm : admission);
+		return (VMPoolItem*) resv.slot;
+
+	} catch (std::exception& e) {
+		this->logf(
+			"VM '%s' exception: %s", config.name.c_str(), e.what());
+		return nullptr;
+	}
+}
+
+VMPoolItem* TenantInstance::vmtryreserve()
+{
+	auto prog = std::atomic_load(&this->program);
+	if (UNLIKELY(prog == nullptr || !prog->is_initialized()))
+		return nullptr;
+	return prog->try_reserve_vm(std::move(prog));
+}
+
 std::shared_ptr<ProgramInstance> TenantInstance::ref(bool debug)
 {
 	std::shared_ptr<ProgramInstance> prog;
@@ -183,6 +217,7 @@ std::shared_ptr<ProgramInstance> TenantInstance::ref(bool debug)
 	// First-time tenants could have no program loaded
 	if (UNLIKELY(prog == nullptr))
 	{
+		const uint64_t t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
 		// Attempt to load the program (if it was never attempted)
 		// XXX: But not for debug programs (NOT IMPLEMENTED YET).
 		if (debug || this->wait_guarded_initialize(prog) == false)
@@ -194,6 +229,13 @@ std::shared_ptr<ProgramInstance> TenantInstance::ref(bool debug)
 		}
 		// On success, prog is now loaded with the new program.
 		// XXX: Assert on prog
+		if (UNLIKELY(this->m_hibernated.exchange(false)) && prog->wait_for_main_vm())
+		{
+			const uint64_t t = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0;
+			this->resurrection_ns.store(t);
+			this->resurrection_ns_total += t;
+			this->resurrections ++;
+		}
 	}
 	// Avoid reservation while still initializing. Wait for lock.
 	// Returns false if the main_vm failed to initialize.
@@ -322,6 +364,31 @@ void TenantInstance::reload_program_live(bool debug)
 	}
 }
 
+bool TenantInstance::hibernate(const ProgramInstance* prog, const char* reason)
+{
+	std::shared_ptr<ProgramInstance> old_prog;
+	{
+		std::scoped_lock lock(this->mtx_running_init);
+		old_prog = std::atomic_load(&this->program);
+		/* The program was live-updated or unloaded meanwhile. */
+		if (old_prog.get() != prog)
+			return false;
+		std::atomic_store(&this->program, std::shared_ptr<ProgramInstance>(nullptr));
+		this->m_started_init = false;
+		this->m_hibernated = true;
+		/* Request threads let go of their VMs when this changes. */
+		this->hibernations ++;
+	}
+	this->logf("Program '%s' is hibernated (%s)\n",
+		config.name.c_str(), reason);
+	/* This can be called from a timer of the program itself, which
+	   cannot be the one to destroy it. */
+	std::thread([old_prog = std::move(old_prog)] () mutable {
+		old_prog = nullptr;
+	}).detach();
+	return true;
+}
+
 void TenantInstance::logf(const char* fmt, ...) const
 {
 	char buffer[2048];
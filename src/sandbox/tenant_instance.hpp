@@ -1,9 +1,11 @@
 #pragma once
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include "live_update.hpp"
+#include "response_cache.hpp"
 #include "tenant.hpp"
 namespace tinykvm { struct vCPU; }
 
@@ -11,11 +13,17 @@ namespace kvm {
 class ProgramInstance;
 class MachineInstance;
 struct VMPoolItem;
+struct VMAdmission;
 
 class TenantInstance {
 public:
-	/* Obtain ownership of a single VM. */
-	VMPoolItem* vmreserve(bool debug);
+	/* Obtain ownership of a single VM. With an admission, the request
+	   waits in line by its priority, and may be turned away early. */
+	VMPoolItem* vmreserve(bool debug, VMAdmission* adm = nullptr);
+	/* Obtain a VM for one request, in weighted fair order by priority. */
+	VMPoolItem* vmborrow(VMAdmission* adm = nullptr);
+	/* Obtain ownership of a VM, only if one is free right now. */
+	VMPoolItem* vmtryreserve();
 
 	/* Append statistics from the current program and all its VMs. */
 	void gather_stats(nlohmann::json& j);
@@ -30,6 +38,10 @@ public:
 
 	/* Reloads/unloads the current program. */
 	void reload_program_live(bool debug);
+	/* Unload an idle program, if it is still the current one. Only the
+	   cold start file (if any) is kept, and the next request loads the
+	   program again. */
+	bool hibernate(const ProgramInstance* prog, const char* reason);
 
 	/* If the tenants program employ serialization callbacks, we can
 	   serialize the important bits of the current program and then
@@ -51,6 +63,16 @@ public:
 	mutable std::shared_ptr<ProgramInstance> program = nullptr;
 	/* Hot-swappable machine for debugging */
 	mutable std::shared_ptr<ProgramInstance> debug_program = nullptr;
+	/* Responses marked cacheable by the program, if enabled */
+	std::unique_ptr<ResponseCache> response_cache = nullptr;
+	/* VMs held as spares by request threads, for reset-ahead */
+	std::atomic<int> spare_vms = 0;
+	/* Idle tenants are hibernated, and resurrected by the next request */
+	std::atomic<uint64_t> last_request = 0; /* Monotonic nanoseconds */
+	std::atomic<uint32_t> hibernations = 0;
+	std::atomic<uint32_t> resurrections = 0;
+	std::atomic<uint64_t> resurrection_ns = 0; /* The last resurrection */
+	std::atomic<uint64_t> resurrection_ns_total = 0;
 
 	/* Logging */
 	void do_log(std::string_view data) const;
@@ -68,6 +90,7 @@ private:
 	bool wait_guarded_initialize(std::shared_ptr<ProgramInstance>&);
 	void handle_exception(const TenantConfig&, const std::exception&);
 	bool m_started_init = false;
+	std::atomic<bool> m_hibernated = false;
 	std::mutex mtx_running_init;
 	static inline logging_func_t m_logger;
 };
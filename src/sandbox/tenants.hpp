@@ -1,5 +1,7 @@
 #pragma once
+#include "router.hpp"
 #include "tenant_instance.hpp"
+#include <atomic>
 #include <unordered_map>
 
 namespace kvm {
@@ -12,6 +14,10 @@ struct Tenants {
 
 	TenantInstance* find(const std::string& name);
 	TenantInstance* find_key(const std::string& name, const std::string& key);
+	/* Find the tenant for a request by its Host header and path. */
+	TenantInstance* route(std::string_view host, std::string_view path) const noexcept {
+		return m_router.load(std::memory_order_acquire)->find(host, path);
+	}
 
 	using foreach_t = std::function<void(TenantInstance*)>;
 	void foreach(foreach_t);
@@ -22,8 +28,14 @@ struct Tenants {
 private:
 	bool load_tenant(const TenantConfig& config, bool initialize);
 	void init_tenants(const std::string_view json_strview, const std::string& source, bool initialize);
+	void build_router();
 
 	std::unordered_map<uint32_t, TenantInstance> m_tenants;
+	/* Routers are replaced, but never freed, as lookups don't hold references. */
+	std::vector<std::unique_ptr<Router>> m_routers;
+	std::atomic<const Router*> m_router { &s_empty_router };
+	std::mutex m_router_mtx;
+	static inline const Router s_empty_router {};
 };
 
 } // kvm
@@ -0,0 +1,102 @@
+#include "vm_handoff.hpp"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace kvm {
+/* Roughly the time it takes to run a small request. Waits longer
+   than this are expected to be rare enough to afford a futex. With a
+   single CPU, spinning only delays the thread we are waiting for. */
+static constexpr int SPIN_ITERATIONS = 4000;
+static const int s_spin_iterations =
+	(std::thread::hardware_concurrency() > 1) ? SPIN_ITERATIONS : 0;
+
+/* Tell the CPU that we are spinning. */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#else
+	std::this_thread::yield();
+#endif
+}
+
+VMHandoff::VMHandoff(int nice, int cpu)
+	: m_thread(&VMHandoff::worker, this, nice, cpu)
+{
+}
+
+VMHandoff::~VMHandoff()
+{
+	m_stop = true;
+	m_submitted.fetch_add(1, std::memory_order_seq_cst);
+	wake(m_submitted, m_worker_parked);
+	m_thread.join();
+}
+
+void VMHandoff::submit()
+{
+	const uint32_t seq = m_submitted.load(std::memory_order_relaxed) + 1;
+	m_submitted.store(seq, std::memory_order_seq_cst);
+	wake(m_submitted, m_worker_parked);
+	wait(m_completed, seq - 1, m_caller_parked);
+}
+
+void VMHandoff::worker(int nice, int cpu)
+{
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	setpriority(PRIO_PROCESS, gettid(), nice);
+
+	uint32_t seq = 0;
+	while (true) {
+		wait(m_submitted, seq, m_worker_parked);
+		seq = m_submitted.load(std::memory_order_acquire);
+		if (m_stop)
+			return;
+		try {
+			m_result = m_call(m_arg);
+		} catch (...) {
+			m_exception = std::current_exception();
+		}
+		m_completed.store(seq, std::memory_order_seq_cst);
+		wake(m_completed, m_caller_parked);
+	}
+}
+
+void VMHandoff::wait(std::atomic<uint32_t>& word, uint32_t old, std::atomic<bool>& parked)
+{
+	for (int i = 0; i < s_spin_iterations; i++) {
+		if (word.load(std::memory_order_acquire) != old)
+			return;
+		cpu_relax();
+	}
+	while (word.load(std::memory_order_acquire) == old) {
+		/* Announce the sleep before checking the word one last time,
+		   so that the waker either sees the flag, or we see the word. */
+		parked.store(true, std::memory_order_seq_cst);
+		if (word.load(std::memory_order_seq_cst) == old) {
+			syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, old, nullptr, nullptr, 0);
+		}
+		parked.store(false, std::memory_order_relaxed);
+	}
+}
+
+void VMHandoff::wake(std::atomic<uint32_t>& word, std::atomic<bool>& parked)
+{
+	if (parked.load(std::memory_order_seq_cst)) {
+		syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+	}
+}
+
+} // kvm
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "common_defs.hpp"
+
+namespace kvm {
+
+/**
+ * VMHandoff runs calls on a dedicated thread, one at a time, for a VM
+ * that is owned by a single request. It is the reservation mode
+ * replacement for a thread pool round-trip: The caller publishes a
+ * call in a single-entry mailbox, and each side spins for a while
+ * before parking on a futex. Nothing is allocated per call, as the
+ * call is a pointer to a callable on the callers stack.
+ *
+ * Only the owner of the VM may call run(), and it waits for the result,
+ * so there is never more than one call in flight.
+**/
+class VMHandoff {
+public:
+	/* Run func on the VM thread, and return its result. Exceptions
+	   thrown by func are rethrown on the calling thread. */
+	template <typename F>
+	long run(F&& func)
+	{
+		using Func = std::remove_reference_t<F>;
+		m_call = [] (void* arg) -> long { return (*static_cast<Func*>(arg))(); };
+		m_arg  = &func;
+		this->submit();
+		if (UNLIKELY(m_exception != nullptr))
+			std::rethrow_exception(std::exchange(m_exception, nullptr));
+		return m_result;
+	}
+
+	/* The thread is pinned to cpu, unless it is negative. */
+	VMHandoff(int nice, int cpu = -1);
+	~VMHandoff();
+
+private:
+	void submit();
+	void worker(int nice, int cpu);
+	/* Spin, then sleep, until word differs from old. */
+	static void wait(std::atomic<uint32_t>& word, uint32_t old, std::atomic<bool>& parked);
+	static void wake(std::atomic<uint32_t>& word, std::atomic<bool>& parked);
+
+	long (*m_call)(void*) = nullptr;
+	void* m_arg = nullptr;
+	long  m_result = 0;
+	std::exception_ptr m_exception;
+	bool  m_stop = false;
+
+	/* Calls submitted, and calls completed. Separate cache lines,
+	   as they are written by different threads. */
+	alignas(64) std::atomic<uint32_t> m_submitted {0};
+	std::atomic<bool> m_worker_parked {false};
+	alignas(64) std::atomic<uint32_t> m_completed {0};
+	std::atomic<bool> m_caller_parked {false};
+
+	std::thread m_thread;
+};
+
+} // kvm
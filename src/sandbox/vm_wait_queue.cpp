@@ -0,0 +1,83 @@
+#include "vm_wait_queue.hpp"
+
+#include <algorithm>
+
+namespace kvm {
+
+bool VMWaitQueue::wait_turn(Waiter& w, clock::time_point deadline)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_lanes[w.priority].push_back(&w);
+	m_lane_size[w.priority].fetch_add(1, std::memory_order_relaxed);
+	m_waiting.fetch_add(1, std::memory_order_relaxed);
+	if (m_turn == nullptr)
+		this->give_turn();
+
+	if (w.cv.wait_until(lock, deadline, [&] { return w.turn; }))
+		return true;
+
+	/* Gave up while still in line. */
+	auto& lane = m_lanes[w.priority];
+	lane.erase(std::find(lane.begin(), lane.end(), &w));
+	m_lane_size[w.priority].fetch_sub(1, std::memory_order_relaxed);
+	m_waiting.fetch_sub(1, std::memory_order_relaxed);
+	return false;
+}
+
+void VMWaitQueue::done(Waiter& w)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	w.turn = false;
+	m_turn = nullptr;
+	m_waiting.fetch_sub(1, std::memory_order_relaxed);
+	this->give_turn();
+}
+
+void VMWaitQueue::give_turn()
+{
+	/* The lane whose next request would start first in virtual time.
+	   Ties go to the higher priority. */
+	int best = -1;
+	double best_start = 0.0;
+	for (int p = 0; p < VMAdmission::NUM_PRIORITIES; p++) {
+		if (m_lanes[p].empty())
+			continue;
+		const double start = std::max(m_vtime, m_finish[p]);
+		if (best < 0 || start < best_start) {
+			best = p;
+			best_start = start;
+		}
+	}
+	if (best < 0)
+		return;
+	m_vtime = best_start;
+	m_finish[best] = best_start + 1.0 / std::max(m_weights[best], 0.001f);
+
+	m_turn = m_lanes[best].front();
+	m_lanes[best].pop_front();
+	m_lane_size[best].fetch_sub(1, std::memory_order_relaxed);
+	m_turn->turn = true;
+	m_turn->cv.notify_one();
+}
+
+uint32_t VMWaitQueue::ahead_of(uint8_t priority) const noexcept
+{
+	/* While a new request waits for k turns of its own lane, every
+	   other lane is served in proportion to its weight. */
+	uint32_t in_lanes = 0;
+	for (const auto& size : m_lane_size)
+		in_lanes += size.load(std::memory_order_relaxed);
+	const uint32_t turn = m_waiting.load(std::memory_order_relaxed) > in_lanes ? 1 : 0;
+
+	const double k = m_lane_size[priority].load(std::memory_order_relaxed) + 1;
+	double ahead = turn + k - 1;
+	for (int p = 0; p < VMAdmission::NUM_PRIORITIES; p++) {
+		if (p == priority)
+			continue;
+		const double share = k * m_weights[p] / std::max(m_weights[priority], 0.001f);
+		ahead += std::min<double>(m_lane_size[p].load(std::memory_order_relaxed), share);
+	}
+	return uint32_t(ahead);
+}
+
+} // kvm
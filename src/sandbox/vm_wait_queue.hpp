@@ -0,0 +1,67 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace kvm {
+
+/* What a request brings to a VM queue, and what it is told back. */
+struct VMAdmission {
+	static constexpr int NUM_PRIORITIES = 4;
+	uint8_t priority = 0;       /* 0 is the highest priority */
+	float   budget = -1.0f;     /* Seconds left to wait for a VM, negative = no limit */
+	float   retry_after = 0.0f; /* Set when the request was turned away */
+};
+
+/**
+ * VMWaitQueue decides the order in which waiting requests take the free
+ * VMs of a program. Requests wait in one lane per priority, and the lanes
+ * are served with start-time fair queuing: Each lane gets a share of the
+ * VMs in proportion to its weight, and no lane is starved. Within a lane,
+ * requests are served first come, first served.
+ *
+ * Only the request whose turn it is waits for a VM. The others sleep on
+ * their own condition variable until they are given the turn.
+**/
+class VMWaitQueue {
+public:
+	using clock = std::chrono::steady_clock;
+	using Weights = std::array<float, VMAdmission::NUM_PRIORITIES>;
+
+	struct Waiter {
+		Waiter(uint8_t p) : priority(p) {}
+		const uint8_t priority;
+		bool turn = false;
+		std::condition_variable cv;
+	};
+
+	/* Wait until it is the turn of w, or the deadline passes. When this
+	   returns true, the waiter must call done() after trying for a VM. */
+	bool wait_turn(Waiter& w, clock::time_point deadline);
+	void done(Waiter& w);
+
+	/* Racy: Requests waiting, including the one whose turn it is. */
+	uint32_t waiting() const noexcept { return m_waiting.load(std::memory_order_relaxed); }
+	/* Racy: Requests that would be served before a new one of priority p. */
+	uint32_t ahead_of(uint8_t priority) const noexcept;
+
+	void set_weights(const Weights& weights) noexcept { m_weights = weights; }
+
+private:
+	void give_turn();
+
+	std::mutex m_mtx;
+	std::array<std::deque<Waiter*>, VMAdmission::NUM_PRIORITIES> m_lanes;
+	std::array<double, VMAdmission::NUM_PRIORITIES> m_finish {};
+	Weights m_weights {8.0f, 4.0f, 2.0f, 1.0f};
+	double  m_vtime = 0.0;
+	Waiter* m_turn = nullptr;
+	std::array<std::atomic<uint32_t>, VMAdmission::NUM_PRIORITIES> m_lane_size {};
+	std::atomic<uint32_t> m_waiting {0};
+};
+
+} // kvm
@@ -0,0 +1,109 @@
+#include "vm_worker_pool.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <numa.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace kvm {
+
+VMWorkerPool& VMWorkerPool::get()
+{
+	/* Leaked on purpose: Tenants are destroyed after function-local
+	   statics that were created later, and their VMs use the pool. */
+	static VMWorkerPool* pool = new VMWorkerPool(REQUEST_VM_NICE);
+	return *pool;
+}
+
+VMWorkerPool::VMWorkerPool(int nice)
+{
+	const bool has_numa = numa_available() >= 0;
+	/* One worker for each CPU we are allowed to run on. */
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &cpus))
+				continue;
+			const int node = has_numa ? std::max(0, numa_node_of_cpu(cpu)) : 0;
+			m_workers.push_back(std::make_unique<Worker>(cpu, node % MAX_NUMA_NODES, nice));
+		}
+	}
+	if (m_workers.empty()) {
+		/* Unpinned, but still shared. */
+		const unsigned count = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 0; i < count; i++)
+			m_workers.push_back(std::make_unique<Worker>(-1, 0, nice));
+	}
+
+	for (auto& worker : m_workers) {
+		auto& node = m_node_workers.at(worker->node());
+		if (node.empty())
+			m_node_list.push_back(worker->node());
+		node.push_back(worker.get());
+	}
+	std::sort(m_node_list.begin(), m_node_list.end());
+}
+
+VMWorkerPool::Worker& VMWorkerPool::assign(int node) noexcept
+{
+	if (node < 0 || node >= MAX_NUMA_NODES || m_node_workers[node].empty())
+		node = m_node_list.front();
+	auto& workers = m_node_workers[node];
+	const unsigned next = m_next[node].fetch_add(1, std::memory_order_relaxed);
+	return *workers[next % workers.size()];
+}
+
+VMWorkerPool::Worker::Worker(int cpu, int node, int nice)
+	: m_cpu(cpu),
+	  m_node(node),
+	  m_thread(&Worker::main_loop, this, nice)
+{
+}
+
+VMWorkerPool::Worker::~Worker()
+{
+	/* An empty task stops the worker. */
+	m_queue.enqueue(std::packaged_task<long()>{});
+	m_thread.join();
+}
+
+std::future<long> VMWorkerPool::Worker::enqueue(std::function<long()> func)
+{
+	std::packaged_task<long()> task(std::move(func));
+	auto future = task.get_future();
+	m_queue.enqueue(std::move(task));
+	return future;
+}
+
+void VMWorkerPool::Worker::main_loop(int nice)
+{
+	if (m_cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(m_cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			fprintf(stderr, "VM worker: Unable to pin to CPU %d\n", m_cpu);
+		}
+		/* Memory for VMs forked and reset here comes from this node,
+		   when it can. The real node is used, as m_node may be folded. */
+		if (numa_available() >= 0) {
+			numa_set_preferred(numa_node_of_cpu(m_cpu));
+		}
+	}
+	setpriority(PRIO_PROCESS, gettid(), nice);
+
+	std::packaged_task<long()> task;
+	while (true) {
+		m_queue.wait_dequeue(task);
+		if (!task.valid())
+			return;
+		/* Exceptions are delivered through the future. */
+		task();
+	}
+}
+
+} // kvm
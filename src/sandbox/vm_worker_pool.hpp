@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <blockingconcurrentqueue.h>
+#include <array>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "settings.hpp"
+
+namespace kvm {
+
+/**
+ * VMWorkerPool is a set of threads, one for each CPU and pinned to it,
+ * that do the background work of request VMs: forking them, and resetting
+ * them between requests. Each VM is assigned a worker for its lifetime,
+ * so its fork and resets always run on the same CPU. Requests themselves
+ * run the vCPU from the thread that handles them (a Drogon I/O thread or
+ * a compute pool thread), so the vCPU does still move between CPUs.
+ * This way thousands of VMs share as many threads as there are CPUs,
+ * instead of having one thread each.
+ *
+ * Workers prefer memory from their own NUMA node, so VMs forked and
+ * reset by a worker have their memory on the node of the worker.
+ *
+ * Tasks must not wait for other VMs, as that would also stall every VM
+ * that shares the worker. Tasks of different tenants do share workers,
+ * so a slow reset of one tenant delays the queued work of the others,
+ * including a sticky VM whose request thread waits on its reset.
+ * Tenant groups with dedicated_vm_threads give each of their VMs a
+ * Worker of its own instead, pinned to the CPU it would have shared.
+**/
+class VMWorkerPool {
+public:
+	class Worker {
+	public:
+		std::future<long> enqueue(std::function<long()> func);
+		size_t racy_queue_size() const { return m_queue.size_approx(); }
+		/* The CPU this worker is pinned to, or -1. */
+		int cpu() const noexcept { return m_cpu; }
+		/* The NUMA node of the CPU, folded into MAX_NUMA_NODES. */
+		int node() const noexcept { return m_node; }
+
+		Worker(int cpu, int node, int nice);
+		~Worker();
+	private:
+		void main_loop(int nice);
+
+		moodycamel::BlockingConcurrentQueue<std::packaged_task<long()>> m_queue;
+		const int m_cpu;
+		const int m_node;
+		std::thread m_thread;
+	};
+
+	/* The pool for all request VMs, created on first use. It is never
+	   destroyed, as VMs may outlive it during static destruction. */
+	static VMWorkerPool& get();
+	/* Pick the worker for a new VM on the given node, spreading VMs
+	   evenly over the CPUs of the node. */
+	Worker& assign(int node) noexcept;
+	size_t size() const noexcept { return m_workers.size(); }
+	/* The nodes that have workers. */
+	const std::vector<int>& nodes() const noexcept { return m_node_list; }
+
+	VMWorkerPool(int nice);
+
+private:
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::array<std::vector<Worker*>, MAX_NUMA_NODES> m_node_workers;
+	std::array<std::atomic<unsigned>, MAX_NUMA_NODES> m_next {};
+	std::vector<int> m_node_list;
+};
+
+} // kvm
@@ -0,0 +1,67 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace kvm {
+
+/**
+ * WorkingMemoryPolicy learns how much working memory the requests of a
+ * program use, and decides how much of it a request VM keeps after its
+ * reset. Keeping too little makes the next request fault in new memory
+ * banks, and keeping too much makes idle VMs hoard memory.
+ *
+ * The banked memory of a VM before its reset is what the request used,
+ * but only when it is more than was kept at the last reset, as kept banks
+ * are not given back by a smaller request. So every PROBE_INTERVAL resets
+ * one keeps nothing, and the next request measures from scratch, which
+ * lets the estimate go down again.
+ *
+ * Shared by all request VMs of a program, and updated racily.
+**/
+class WorkingMemoryPolicy {
+public:
+	static constexpr uint64_t PROBE_INTERVAL = 32;
+
+	void configure(uint64_t min_bytes, uint64_t max_bytes) noexcept {
+		m_min = std::min(min_bytes, max_bytes);
+		m_max = max_bytes;
+	}
+
+	/* The bytes a VM should keep at this reset. banked is the banked
+	   memory of the VM before the reset, and kept is what the VM was
+	   told to keep at its previous reset, which is updated. */
+	uint64_t retain(uint64_t banked, uint64_t& kept) noexcept
+	{
+		if (banked > kept) {
+			const uint64_t est = m_estimate.load(std::memory_order_relaxed);
+			m_estimate.store(est == 0 ? banked : est - est / 4 + banked / 4,
+				std::memory_order_relaxed);
+		}
+		if (m_resets.fetch_add(1, std::memory_order_relaxed) % PROBE_INTERVAL == PROBE_INTERVAL - 1) {
+			m_probes.fetch_add(1, std::memory_order_relaxed);
+			kept = 0;
+			return 0;
+		}
+		kept = this->retained();
+		return kept;
+	}
+
+	/* The working set of a request, as estimated so far. */
+	uint64_t estimate() const noexcept { return m_estimate.load(std::memory_order_relaxed); }
+	/* What VMs keep after a reset: the estimate with some headroom. */
+	uint64_t retained() const noexcept {
+		const uint64_t est = this->estimate();
+		return std::clamp(est + est / 4, m_min, m_max);
+	}
+	uint64_t probes() const noexcept { return m_probes.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> m_estimate {0};
+	std::atomic<uint64_t> m_resets {0};
+	std::atomic<uint64_t> m_probes {0};
+	uint64_t m_min = 0;
+	uint64_t m_max = UINT64_MAX;
+};
+
+} // kvm
@@ -14,6 +14,7 @@ struct Settings
 	bool reservations = false;
 	bool ephemeral = true;
 	bool double_buffered = false;
+	bool lazy_forking = false; /* Fork request VMs on demand, from one */
 	bool profiling = false;
 	bool verbose = false;
 	bool debug_boot = false;
@@ -21,20 +22,31 @@ struct Settings
 	SnapshotProfilingMode snapshot_profiling_mode = SNAPSHOT_PROFILING_NONE;
 	int  profiling_interval = 1000;
 	int  concurrency = 0;
+	int  io_threads = 0; /* Asynchronous mode when non-zero */
+	int  slot_cache_size = 4; /* Tenants per thread that keep their VMs */
+	int  reservation_threads = 160; /* Request threads with reservations */
+	size_t vm_memory_budget = 0; /* MiB for all VMs, 0 = unlimited */
 	std::string json = "tenants.json";
 	std::string default_tenant = "test.com";
 	std::string host = "127.0.0.1";
 	int port = 8080;
+	size_t max_body_size = 1UL << 20; /* Drogon default: 1MB */
 	std::string drogon_library_path = "./program/libdrogon.so";
 
 	int num_threads() const {
 		if (reservations) {
-			return 160; // Fixed number of threads for reservations
+			return reservation_threads;
 		} else if (concurrency > 0) {
 			return concurrency;
 		} else {
 			return std::thread::hardware_concurrency(); // Default to hardware concurrency
 		}
 	}
+	/* In asynchronous mode the I/O loops are sized separately,
+	   and num_threads() is the number of VM workers. */
+	bool async() const noexcept { return io_threads > 0; }
+	int num_io_threads() const {
+		return async() ? io_threads : num_threads();
+	}
 };
 extern Settings g_settings;